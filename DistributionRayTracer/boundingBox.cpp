@@ -48,8 +48,17 @@ Vector AABB::centroid(void) const {
 	return (min + max) / 2;
 }
 
+// --------------------------------------------------------------------- surface area
+// used by the SAH to estimate the probability of a ray hitting the box
+
+float AABB::area(void) const {
+	Vector d = max - min;
+	if (d.x < 0 || d.y < 0 || d.z < 0) return 0.0f;  //empty box
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
 // --------------------------------------------------------------------- extend AABB
-void AABB::extend(AABB box) {
+void AABB::extend(const AABB& box) {
 	if (min.x > box.min.x) min.x = box.min.x;
 	if (min.y > box.min.y) min.y = box.min.y;
 	if (min.z > box.min.z) min.z = box.min.z;
@@ -59,6 +68,30 @@ void AABB::extend(AABB box) {
 	if (max.z < box.max.z) max.z = box.max.z;
 }
 
+// --------------------------------------------------------------------- extend AABB with a point
+void AABB::extend(const Vector& p) {
+	if (min.x > p.x) min.x = p.x;
+	if (min.y > p.y) min.y = p.y;
+	if (min.z > p.z) min.z = p.z;
+
+	if (max.x < p.x) max.x = p.x;
+	if (max.y < p.y) max.y = p.y;
+	if (max.z < p.z) max.z = p.z;
+}
+
+// --------------------------------------------------------------------- clip AABB to another one
+// the result is empty (min > max on some axis) if the boxes don't overlap
+
+void AABB::clip(const AABB& box) {
+	if (min.x < box.min.x) min.x = box.min.x;
+	if (min.y < box.min.y) min.y = box.min.y;
+	if (min.z < box.min.z) min.z = box.min.z;
+
+	if (max.x > box.max.x) max.x = box.max.x;
+	if (max.y > box.max.y) max.y = box.max.y;
+	if (max.z > box.max.z) max.z = box.max.z;
+}
+
 // --------------------------------------------------------------------- AABB intersection
 
 bool AABB::hit(const Ray& ray, float& t) const
@@ -16,6 +16,9 @@ public:
 	bool isInside(const Vector& p) const;
 	bool hit(const Ray& r, float& t) const;
 	Vector centroid(void) const;
-	void extend(AABB box);
+	float area(void) const;
+	void extend(const AABB& box);
+	void extend(const Vector& p);
+	void clip(const AABB& box);
 
 };
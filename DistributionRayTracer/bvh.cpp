@@ -1,82 +1,886 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include "rayAccelerator.h"
 #include "macros.h"
 
 using namespace std;
 
+// OMP tasks need OpenMP 3.0 (MSVC's /openmp is 2.0): without them the BVH is built serially
+#if defined(_OPENMP) && _OPENMP >= 200805
+#define BVH_OMP_TASKS 1
+#else
+#define BVH_OMP_TASKS 0
+#endif
+
 BVH::BVHNode::BVHNode(void) {}
 
-void BVH::BVHNode::setAABB(AABB& bbox_) { this->bbox = bbox_; }
+void BVH::BVHNode::setAABB(const AABB& bbox_) {
+	this->min = bbox_.min;
+	this->max = bbox_.max;
+}
 
 void BVH::BVHNode::makeLeaf(unsigned int index_, unsigned int n_objs_) {
 	this->leaf = true;
 	this->index = index_;
 	this->n_objs = n_objs_;
+	this->axis = 0;
 }
 
-void BVH::BVHNode::makeNode(unsigned int left_index_) {
+void BVH::BVHNode::makeNode(unsigned int right_index_, int axis_) {
 	this->leaf = false;
-	this->index = left_index_;
+	this->index = right_index_;
+	this->n_objs = 0;
+	this->axis = axis_;
+}
+
+// Slab test against 4 boxes at once, given as bounds[0] = min and bounds[1] = max per axis. The near plane
+// of each slab is chosen by the sign of the direction, so inverted (empty) boxes are never hit. Returns a
+// bit mask of the boxes hit within [t_min, t_max], with their entry distances in t
+static inline int hit4(const __m128 bounds[2][3], const __m128 origin[3], const __m128 inv_dir[3], const int sign[3], float t_min, float t_max, float t[4]) {
+	__m128 t_near = _mm_set1_ps(t_min);
+	__m128 t_far = _mm_set1_ps(t_max);
+
+	for (int axis = 0; axis < 3; axis++) {
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(bounds[sign[axis]][axis], origin[axis]), inv_dir[axis]);
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(bounds[1 - sign[axis]][axis], origin[axis]), inv_dir[axis]);
+		//the running value goes second: SSE min/max return it when t0/t1 is a NaN (0 * inf)
+		t_near = _mm_max_ps(t0, t_near);
+		t_far = _mm_min_ps(t1, t_far);
+	}
+
+	_mm_storeu_ps(t, t_near);
+	return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
 }
 
+// Conservative slab test of a whole packet against 4 boxes: the origins and inverse directions of its rays
+// are given as intervals per axis, and the directions must all have the same signs. Interval arithmetic
+// bounds the entry distance from below and the exit distance from above, so a box missed by this test
+// is missed by every ray of the packet
+static inline int hit4_interval(const __m128 bounds[2][3], const __m128 origin_lo[3], const __m128 origin_hi[3],
+	const __m128 inv_lo[3], const __m128 inv_hi[3], const int sign[3], float t_min, float t_max) {
+	__m128 t_near = _mm_set1_ps(t_min);
+	__m128 t_far = _mm_set1_ps(t_max);
+
+	for (int axis = 0; axis < 3; axis++) {
+		__m128 near_lo = _mm_sub_ps(bounds[sign[axis]][axis], origin_hi[axis]);
+		__m128 near_hi = _mm_sub_ps(bounds[sign[axis]][axis], origin_lo[axis]);
+		__m128 far_lo = _mm_sub_ps(bounds[1 - sign[axis]][axis], origin_hi[axis]);
+		__m128 far_hi = _mm_sub_ps(bounds[1 - sign[axis]][axis], origin_lo[axis]);
+
+		__m128 t0 = _mm_min_ps(_mm_min_ps(_mm_mul_ps(near_lo, inv_lo[axis]), _mm_mul_ps(near_lo, inv_hi[axis])),
+			_mm_min_ps(_mm_mul_ps(near_hi, inv_lo[axis]), _mm_mul_ps(near_hi, inv_hi[axis])));
+		__m128 t1 = _mm_max_ps(_mm_max_ps(_mm_mul_ps(far_lo, inv_lo[axis]), _mm_mul_ps(far_lo, inv_hi[axis])),
+			_mm_max_ps(_mm_mul_ps(far_hi, inv_lo[axis]), _mm_mul_ps(far_hi, inv_hi[axis])));
+		t_near = _mm_max_ps(t0, t_near);
+		t_far = _mm_min_ps(t1, t_far);
+	}
+
+	return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+}
+
+void BVH::BVH4Node::bounds(__m128 b[2][3]) const {
+	b[0][0] = _mm_load_ps(min_x); b[0][1] = _mm_load_ps(min_y); b[0][2] = _mm_load_ps(min_z);
+	b[1][0] = _mm_load_ps(max_x); b[1][1] = _mm_load_ps(max_y); b[1][2] = _mm_load_ps(max_z);
+}
+
+int BVH::BVH4Node::hit(const __m128 origin[3], const __m128 inv_dir[3], const int sign[3], float t_min, float t_max, float t[4]) const {
+	__m128 b[2][3];
+	bounds(b);
+	return hit4(b, origin, inv_dir, sign, t_min, t_max, t);
+}
+
+// Widens 4 bytes to 4 floats (SSE2)
+static inline __m128 bytes_to_floats(const unsigned char bytes[4]) {
+	int packed;
+	memcpy(&packed, bytes, sizeof(packed));
+	__m128i zero = _mm_setzero_si128();
+	__m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+	return _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+}
+
+void BVH::BVH4QNode::bounds(__m128 b[2][3]) const {
+	for (int axis = 0; axis < 3; axis++) {
+		//2^exponent built straight from its bits; exact, so the decoded boxes are the ones quantize() checked
+		__m128 step = _mm_castsi128_ps(_mm_set1_epi32((exponent[axis] + 127) << 23));
+		__m128 base = _mm_set1_ps(origin[axis]);
+		b[0][axis] = _mm_add_ps(base, _mm_mul_ps(bytes_to_floats(min_q[axis]), step));
+		b[1][axis] = _mm_add_ps(base, _mm_mul_ps(bytes_to_floats(max_q[axis]), step));
+	}
+}
+
+int BVH::BVH4QNode::hit(const __m128 ray_origin[3], const __m128 inv_dir[3], const int sign[3], float t_min, float t_max, float t[4]) const {
+	__m128 b[2][3];
+	bounds(b);
+	return hit4(b, ray_origin, inv_dir, sign, t_min, t_max, t);
+}
 
 BVH::BVH(void) {}
 
 int BVH::getNumObjects() { return objects.size(); }
 
 
-void BVH::Build(vector<Object *> &objs) {
+void BVH::Build(vector<PrimId> &objs) {
 
 
-			BVHNode *root = new BVHNode();
+			BuildNode *build_root;
 
 			Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
 			AABB world_bbox = AABB(min, max);
 
-			for (Object* obj : objs) {
+			//Build is also called by Refit to start over
+			scene_objects = objs;
+			objects.clear();
+			unbounded.clear();
+			nodes.clear();
+			wide_nodes.clear();
+
+			for (PrimId id : objs) {
+				Object* obj = primitives->Get(id);
+				if (!obj->IsBounded()) {
+					unbounded.push_back(id);
+					continue;
+				}
 				AABB bbox = obj->GetBoundingBox();
 				world_bbox.extend(bbox);
-				objects.push_back(obj);
+				objects.push_back(id);
+				prims.push_back({ bbox, bbox.centroid(), id });
+			}
+			if (objects.empty()) {   //nothing but planes: no tree
+				leaf_blocks.clear();
+				build_sah_cost = 0.0f;
+				printf("\nBVH: no bounded objects, %d unbounded\n\n", (int)unbounded.size());
+				return;
 			}
 			world_bbox.min.x -= EPSILON; world_bbox.min.y -= EPSILON; world_bbox.min.z -= EPSILON;
 			world_bbox.max.x += EPSILON; world_bbox.max.y += EPSILON; world_bbox.max.z += EPSILON;
-			root->setAABB(world_bbox);
-			nodes.push_back(root);
-			build_recursive(0, objects.size(), root); // -> root node takes all the objects
+			auto timeStart = std::chrono::high_resolution_clock::now();
+
+			if (builder == LBVH_BUILD)
+				build_root = build_lbvh();
+			else if (builder == SBVH_BUILD) {
+				//the references are rebuilt into prims leaf by leaf, possibly more than once per object
+				vector<BVHPrim> refs;
+				refs.swap(prims);
+				sbvh_budget = (int)(SBVHDuplicationBudget * objects.size());   //of the bounded objects only
+				sbvh_root_area = world_bbox.area();
+				build_root = build_sbvh(refs, world_bbox);
+			}
+			else {
+				build_root = new BuildNode();
+				build_root->bbox = world_bbox;
+
+				//subtrees are built in OMP tasks; the implicit barrier at the end of the parallel region waits for all of them
+#if BVH_OMP_TASKS
+#pragma omp parallel
+#pragma omp single
+#endif
+				build_recursive(0, objects.size(), build_root); // -> root node takes all the objects
+			}
+
+			//the serial flattening numbers the nodes always in the same order, no matter how the tasks were scheduled
+			nodes.reserve(2 * prims.size() + 1);
+			flatten(build_root);
+			build_wide_nodes();
+
+			//objects vector must follow the order in which the builder left the primitives
+			objects.resize(prims.size());
+			for (size_t i = 0; i < prims.size(); i++)
+				objects[i] = prims[i].obj;
+			prims.clear();
+			prims.shrink_to_fit();
+			build_leaf_blocks();
+
+			auto timeEnd = std::chrono::high_resolution_clock::now();
+			double buildTime = std::chrono::duration<double, std::milli>(timeEnd - timeStart).count();
+
+			int n_leaves = 0;
+			for (const BVHNode& node : nodes)
+				if (node.isLeaf()) n_leaves++;
+			build_sah_cost = ComputeSAHCost();
+			const char* name = builder == LBVH_BUILD ? "LBVH" : builder == SBVH_BUILD ? "SBVH" : "BVH";
+			int wide_node_size = quantized ? sizeof(BVH4QNode) : sizeof(BVH4Node);
+			printf("\n%s: total nodes = %d, leaves = %d, BVH4 nodes = %d (%d bytes each, %.1f KB), total objects = %d, references = %d, SAH cost = %f, build time = %.1f ms\n\n",
+				name, (int)nodes.size(), n_leaves, (int)wide_nodes.size(), wide_node_size, wide_nodes.size() * wide_node_size / 1024.0,
+				(int)objs.size(), this->getNumObjects(), build_sah_cost, buildTime);
+		}
+
+// Bins the n_refs objects starting at refs by their centroid along the 3 axes
+void BVH::bin_objects(const BVHPrim* refs, int n_refs, const AABB& centroid_bbox, Bins& bins) const {
+	float cmin[3], k[3];
+	for (int axis = 0; axis < 3; axis++) {
+		cmin[axis] = centroid_bbox.min.getAxisValue(axis);
+		float extent = centroid_bbox.max.getAxisValue(axis) - cmin[axis];
+		k[axis] = (extent > 0.0f) ? NumBins / extent : 0.0f;   //flat axis: everything falls in bin 0
+
+		for (int b = 0; b < NumBins; b++) {
+			bins.bbox[axis][b] = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+			bins.count[axis][b] = 0;
 		}
+	}
 
-void BVH::build_recursive(int left_index, int right_index, BVHNode *node) {
+	for (int i = 0; i < n_refs; i++) {
+		for (int axis = 0; axis < 3; axis++) {
+			int b = MIN(NumBins - 1, (int)(k[axis] * (refs[i].centroid.getAxisValue(axis) - cmin[axis])));
+			bins.bbox[axis][b].extend(refs[i].bbox);
+			bins.count[axis][b]++;
+		}
+	}
+}
+
+// Binned SAH: for every axis, find the plane between bins with the lowest expected cost
+//   C = C_trav + C_isect * (SA(L) * N(L) + SA(R) * N(R)) / SA(node)
+// Returns FLT_MAX and best_axis = -1 if the objects can't be split
+float BVH::find_object_split(const Bins& bins, const AABB& centroid_bbox, float inv_node_area, int& best_axis, int& best_split) const {
+	float best_cost = FLT_MAX;
+	best_axis = -1;
+	best_split = -1;
+
+	float right_area[NumBins];
+	int right_count[NumBins];
+
+	for (int axis = 0; axis < 3; axis++) {
+		if (centroid_bbox.max.getAxisValue(axis) <= centroid_bbox.min.getAxisValue(axis))
+			continue;   //all centroids on the same plane: cannot split along this axis
+
+		//sweep from the right to get the area and count of everything to the right of each plane
+		AABB acc = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+		int count = 0;
+		for (int b = NumBins - 1; b > 0; b--) {
+			acc.extend(bins.bbox[axis][b]);
+			count += bins.count[axis][b];
+			right_area[b - 1] = acc.area();
+			right_count[b - 1] = count;
+		}
 
-	//PUT YOUR CODE HERE
+		//sweep from the left and evaluate the cost of each plane
+		acc = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+		count = 0;
+		for (int b = 0; b < NumBins - 1; b++) {
+			acc.extend(bins.bbox[axis][b]);
+			count += bins.count[axis][b];
+			if (count == 0 || right_count[b] == 0) continue;
+
+			float cost = TraversalCost + IntersectionCost * (acc.area() * count + right_area[b] * right_count[b]) * inv_node_area;
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_split = b;
+			}
+		}
+	}
+	return best_cost;
+}
+
+void BVH::build_recursive(int left_index, int right_index, BuildNode *node) {
 
 		//right_index, left_index and split_index refer to the indices in the objects vector
 	   // do not confuse with left_nodde_index and right_node_index which refer to indices in the nodes vector.
 	    // node.index can have a index of objects vector or a index of nodes vector
 
+	int n_objs = right_index - left_index;
+	if (n_objs <= 1) {
+		node->index = left_index;
+		node->n_objs = n_objs;
+		return;
+	}
+
+	// the objects are binned by their centroids, so only the centroids' extent matters
+	AABB centroid_bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	for (int i = left_index; i < right_index; i++)
+		centroid_bbox.extend(prims[i].centroid);
+
+	Bins bins;
+	if (n_objs > ParallelBinSize) {
+		// top levels of the tree: bin chunks of the range in parallel and merge them.
+		// Merging only takes unions and sums, so the result is the same as binning serially
+		int chunk_size = ParallelBinSize / 4;
+		int n_chunks = (n_objs + chunk_size - 1) / chunk_size;
+		vector<Bins> chunk_bins(n_chunks);
+
+		for (int c = 0; c < n_chunks; c++) {
+#if BVH_OMP_TASKS
+#pragma omp task shared(chunk_bins, centroid_bbox)
+#endif
+			bin_objects(prims.data() + left_index + c * chunk_size, MIN(chunk_size, n_objs - c * chunk_size), centroid_bbox, chunk_bins[c]);
+		}
+#if BVH_OMP_TASKS
+#pragma omp taskwait
+#endif
+
+		bins = chunk_bins[0];
+		for (int c = 1; c < n_chunks; c++)
+			for (int axis = 0; axis < 3; axis++)
+				for (int b = 0; b < NumBins; b++) {
+					bins.bbox[axis][b].extend(chunk_bins[c].bbox[axis][b]);
+					bins.count[axis][b] += chunk_bins[c].count[axis][b];
+				}
+	}
+	else
+		bin_objects(prims.data() + left_index, n_objs, centroid_bbox, bins);
+
+	int best_axis, best_split;   // objects in bins [0, best_split] go to the left child
+	float best_cost = find_object_split(bins, centroid_bbox, 1.0f / node->bbox.area(), best_axis, best_split);
+
+	// leaf termination: stop when intersecting every object is cheaper than the best split
+	float leaf_cost = IntersectionCost * n_objs;
+	if (n_objs <= MaxLeafSize && (best_axis == -1 || leaf_cost <= best_cost)) {
+		node->index = left_index;
+		node->n_objs = n_objs;
+		return;
+	}
+
+	node->children[0] = new BuildNode();
+	node->children[1] = new BuildNode();
+	node->axis = MAX(best_axis, 0);
+	AABB& left_bbox = node->children[0]->bbox;
+	AABB& right_bbox = node->children[1]->bbox;
+	left_bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	right_bbox = left_bbox;
+
+	int split_index;
+	if (best_axis != -1) {
+		float cmin = centroid_bbox.min.getAxisValue(best_axis);
+		float k = NumBins / (centroid_bbox.max.getAxisValue(best_axis) - cmin);
+		auto mid = partition(prims.begin() + left_index, prims.begin() + right_index, [&](const BVHPrim& p) {
+			return MIN(NumBins - 1, (int)(k * (p.centroid.getAxisValue(best_axis) - cmin))) <= best_split;
+		});
+		split_index = mid - prims.begin();
+
+		//the bins hold the exact bounds of their objects, so the children's boxes come for free
+		for (int b = 0; b < NumBins; b++)
+			(b <= best_split ? left_bbox : right_bbox).extend(bins.bbox[best_axis][b]);
+	}
+	else {
+		// every centroid is the same point but there are too many objects for a leaf: split in half
+		Comparator cmp;
+		cmp.dimension = 0;
+		split_index = left_index + n_objs / 2;
+		nth_element(prims.begin() + left_index, prims.begin() + split_index, prims.begin() + right_index, cmp);
+
+		for (int i = left_index; i < split_index; i++)
+			left_bbox.extend(prims[i].bbox);
+		for (int i = split_index; i < right_index; i++)
+			right_bbox.extend(prims[i].bbox);
+	}
+
+	// large subtrees go to another thread; both halves work on disjoint ranges of prims
+	if (n_objs > ParallelTaskSize) {
+#if BVH_OMP_TASKS
+#pragma omp task
+#endif
+		build_recursive(left_index, split_index, node->children[0]);
+	}
+	else
+		build_recursive(left_index, split_index, node->children[0]);
+	build_recursive(split_index, right_index, node->children[1]);
+	}
+
+// Copies the build tree into the nodes vector (deleting it on the way) in depth-first order,
+// so the first child of every interior node is the next node. Returns the node index
+int BVH::flatten(BuildNode* build_node) {
+	int node_index = nodes.size();
+	nodes.emplace_back();
+	nodes[node_index].setAABB(build_node->bbox);
+
+	if (build_node->children[0] == NULL)
+		nodes[node_index].makeLeaf(build_node->index, build_node->n_objs);
+	else {
+		flatten(build_node->children[0]);
+		int right_index = flatten(build_node->children[1]);
+		nodes[node_index].makeNode(right_index, build_node->axis);
+	}
+	delete build_node;
+	return node_index;
+}
+
+// Recomputes the bounds of the subtree rooted at node_index from the current bounding boxes of its
+// objects. SBVH references get the bounds of the whole object, not of their part: looser, still correct
+AABB BVH::refit_recursive(int node_index) {
+	BVHNode& node = nodes[node_index];
+	AABB bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+
+	if (node.isLeaf()) {
+		for (unsigned int i = 0; i < node.getNObjs(); i++)
+			bbox.extend(primitives->Get(objects[node.getIndex() + i])->GetBoundingBox());
+	}
+	else {
+		//the left subtree holds the nodes between this one and the right child
+		int right_index = node.getIndex();
+		AABB left_bbox;
+#if BVH_OMP_TASKS
+#pragma omp task shared(left_bbox) if (right_index - node_index > ParallelTaskSize)
+#endif
+		left_bbox = refit_recursive(node_index + 1);
+		bbox = refit_recursive(right_index);
+#if BVH_OMP_TASKS
+#pragma omp taskwait
+#endif
+		bbox.extend(left_bbox);
+	}
+
+	node.setAABB(bbox);
+	return bbox;
+}
+
+// Updates the BVH after its objects moved, keeping the topology of the tree. When the SAH cost has grown
+// past RebuildThreshold times the cost of the last build, the tree is rebuilt from scratch instead
+void BVH::Refit() {
+	if (nodes.empty()) return;
+
+#if BVH_OMP_TASKS
+#pragma omp parallel
+#pragma omp single
+#endif
+	refit_recursive(0);
+
+	//the 4-wide nodes are cheap to collapse again, and the best children to open may have changed
+	build_wide_nodes();
+	build_leaf_blocks();   //the objects moved
+
+	//runs every frame of an animation: only a rebuild is reported
+	if (ComputeSAHCost() > RebuildThreshold * build_sah_cost) {
+		printf("BVH quality degraded, rebuilding\n");
+		Build(scene_objects);
 	}
+}
+
+// Builds the 4-wide nodes used for traversal out of the binary ones
+void BVH::build_wide_nodes() {
+	wide_nodes.clear();
+	wide_nodes.reserve(nodes.size() / 2 + 1);
+	collapse(0);
+	if (quantized)
+		quantize();
+
+	stack_size = traversal_stack_size();
+	if (stack_size > TraversalStackSize)
+		printf("BVH too deep: traversal needs a stack of %d entries, more than the %d on the thread's stack; using the heap\n",
+			stack_size, TraversalStackSize);
+}
+
+// Largest number of entries the traversal stack can hold. Visiting a node pops it and pushes its
+// interior children; all but one of them stay on the stack while the subtree of that one is visited.
+// Children come after their parent in wide_nodes, so the nodes are processed backwards
+int BVH::traversal_stack_size(void) const {
+	vector<int> need(wide_nodes.size());
+	for (int n = (int)wide_nodes.size() - 1; n >= 0; n--) {
+		int n_interior = 0, deepest = 1;
+		for (int i = 0; i < 4; i++) {
+			if (wide_nodes[n].n_objs[i] != 0 || wide_nodes[n].child[i] == -1) continue;
+			n_interior++;
+			deepest = MAX(deepest, need[wide_nodes[n].child[i]]);
+		}
+		need[n] = n_interior == 0 ? 0 : n_interior - 1 + deepest;
+	}
+	return wide_nodes.empty() ? 0 : MAX(1, need[0]);
+}
+
+// Collapses the binary subtree rooted at node_index into 4-wide nodes: the interior child with the
+// largest area is replaced by its two children until there are 4 of them or all are leaves
+int BVH::collapse(int node_index) {
+	int slots[4], n_slots = 0;
+
+	if (nodes[node_index].isLeaf())
+		slots[n_slots++] = node_index;   //only happens at the root
+	else {
+		slots[n_slots++] = node_index + 1;
+		slots[n_slots++] = nodes[node_index].getIndex();
+	}
+
+	while (n_slots < 4) {
+		int best = -1;
+		float best_area = -1.0f;
+		for (int i = 0; i < n_slots; i++) {
+			const BVHNode& slot = nodes[slots[i]];
+			if (!slot.isLeaf() && slot.getAABB().area() > best_area) {
+				best = i;
+				best_area = slot.getAABB().area();
+			}
+		}
+		if (best == -1) break;
+
+		int opened = slots[best];
+		slots[best] = opened + 1;
+		slots[n_slots++] = nodes[opened].getIndex();
+	}
+
+	int wide_index = wide_nodes.size();
+	wide_nodes.emplace_back();
+
+	for (int i = 0; i < 4; i++) {
+		AABB bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+		int child = -1, n_objs = 0;
+
+		if (i < n_slots && !(nodes[slots[i]].isLeaf() && nodes[slots[i]].getNObjs() == 0)) {
+			const BVHNode& slot = nodes[slots[i]];
+			bbox = slot.getAABB();
+			if (slot.isLeaf()) {
+				child = slot.getIndex();
+				n_objs = slot.getNObjs();
+			}
+			else
+				child = collapse(slots[i]);
+		}
+
+		//collapse() grows wide_nodes, so the node is looked up again
+		BVH4Node& wide_node = wide_nodes[wide_index];
+		wide_node.min_x[i] = bbox.min.x; wide_node.min_y[i] = bbox.min.y; wide_node.min_z[i] = bbox.min.z;
+		wide_node.max_x[i] = bbox.max.x; wide_node.max_y[i] = bbox.max.y; wide_node.max_z[i] = bbox.max.z;
+		wide_node.child[i] = child;
+		wide_node.n_objs[i] = n_objs;
+	}
+	return wide_index;
+}
+
+// Builds the quantized copy of the 4-wide nodes. Per axis, the grid of a node starts at the min of its
+// children and has the smallest power of two step that spans them in 255 steps. Mins are rounded down
+// and maxes up, checking the decoded values with the same float operations as the traversal
+void BVH::quantize() {
+	int n_nodes = wide_nodes.size();
+	quantized_nodes.resize(n_nodes);
+
+#pragma omp parallel for
+	for (int n = 0; n < n_nodes; n++) {
+		const BVH4Node& node = wide_nodes[n];
+		BVH4QNode& qnode = quantized_nodes[n];
+		const float* mins[3] = { node.min_x, node.min_y, node.min_z };
+		const float* maxs[3] = { node.max_x, node.max_y, node.max_z };
+
+		for (int axis = 0; axis < 3; axis++) {
+			float lo = FLT_MAX, hi = -FLT_MAX;
+			for (int i = 0; i < 4; i++)
+				if (mins[axis][i] <= maxs[axis][i]) {
+					lo = MIN(lo, mins[axis][i]);
+					hi = MAX(hi, maxs[axis][i]);
+				}
+			if (lo > hi) lo = hi = 0.0f;   //no children
+
+			int exponent;
+			frexp((hi - lo) / 255.0f, &exponent);
+			exponent = MAX(exponent, -126);
+			//the step must not vanish next to lo, or empty slots could not be told apart
+			while (lo + 255.0f * ldexp(1.0f, exponent) < hi || lo + ldexp(1.0f, exponent) == lo)
+				exponent++;
+			float step = ldexp(1.0f, exponent);
+
+			qnode.origin[axis] = lo;
+			qnode.exponent[axis] = exponent;
+			for (int i = 0; i < 4; i++) {
+				if (mins[axis][i] > maxs[axis][i]) {
+					qnode.min_q[axis][i] = 255;
+					qnode.max_q[axis][i] = 0;
+					continue;
+				}
+				int q_min = MIN(255, MAX(0, (int)floor((mins[axis][i] - lo) / step)));
+				int q_max = MIN(255, MAX(0, (int)ceil((maxs[axis][i] - lo) / step)));
+				while (q_min > 0 && lo + q_min * step > mins[axis][i]) q_min--;
+				while (q_max < 255 && lo + q_max * step < maxs[axis][i]) q_max++;
+				qnode.min_q[axis][i] = q_min;
+				qnode.max_q[axis][i] = q_max;
+			}
+		}
+
+		for (int i = 0; i < 4; i++) {
+			qnode.child[i] = node.child[i];
+			qnode.n_objs[i] = node.n_objs[i];
+		}
+	}
+}
+
+// SAH cost of the whole tree, relative to the root: interior nodes are weighted by
+// TraversalCost and leaves by IntersectionCost times their number of objects
+float BVH::ComputeSAHCost() const {
+	if (nodes.empty() || nodes[0].getAABB().area() == 0.0f) return 0.0f;
+
+	float cost = 0.0f;
+	for (const BVHNode& node : nodes) {
+		if (node.isLeaf())
+			cost += IntersectionCost * node.getNObjs() * node.getAABB().area();
+		else
+			cost += TraversalCost * node.getAABB().area();
+	}
+	return cost / nodes[0].getAABB().area();
+}
+
+// Packs the triangles or the spheres of each leaf in SIMD blocks. The leaves are the slots of the 4-wide
+// nodes holding objects, so this follows every change of the nodes or of the objects' order
+void BVH::build_leaf_blocks() {
+	leaf_packs.Clear();
+	leaf_blocks.assign(objects.size(), -1);
+	for (const BVH4Node& node : wide_nodes)
+		for (int i = 0; i < 4; i++)
+			if (node.n_objs[i] != 0)
+				leaf_blocks[node.child[i]] = leaf_packs.Add(*primitives, &objects[node.child[i]], node.n_objs[i]);
+}
+
+// Closest hit within the ray's interval among the n_objs objects of the leaf starting at first: lowers
+// ray.tmax to it and fills hit_obj and hitRec. Leaves of triangles or of spheres are tested a block at a time
+bool BVH::hit_leaf(int first, int n_objs, Ray& ray, const Object** hit_obj, HitRecord& hitRec) const {
+	int block = leaf_blocks[first];
+	if (block != -1) {
+		int j = leaf_packs.Hit(block, n_objs, ray, hitRec);
+		if (j < 0) return false;
+		ray.tmax = hitRec.t;
+		*hit_obj = primitives->Get(objects[first + j]);
+		return true;
+	}
+
+	int hit = -1;
+	for (int j = 0; j < n_objs; j++) {
+		HitRecord rec = primitives->Hit(objects[first + j], ray);
+		if (rec.isHit) {   //within the ray's interval, so closer than any previous hit
+			ray.tmax = rec.t;
+			hitRec = rec;
+			hit = j;
+		}
+	}
+	if (hit < 0) return false;
+	*hit_obj = primitives->Get(objects[first + hit]);
+	return true;
+}
+
+bool BVH::occludes_leaf(int first, int n_objs, Ray& ray) const {
+	int block = leaf_blocks[first];
+	if (block != -1)
+		return leaf_packs.Occludes(block, n_objs, ray);
+
+	for (int j = 0; j < n_objs; j++)
+		if (primitives->Occludes(objects[first + j], ray))
+			return true;
+	return false;
+}
+
+// Closest hit among the unbounded objects: lowers ray.tmax to it, as hit_leaf does
+bool BVH::hit_unbounded(Ray& ray, const Object** hit_obj, HitRecord& hitRec) const {
+	bool hit = false;
+	for (PrimId id : unbounded) {
+		HitRecord rec = primitives->Hit(id, ray);
+		if (rec.isHit) {
+			ray.tmax = rec.t;
+			hitRec = rec;
+			*hit_obj = primitives->Get(id);
+			hit = true;
+		}
+	}
+	return hit;
+}
 
 bool BVH::Traverse(Ray& ray, const Object** hit_obj, HitRecord& hitRec) const {
-			float tmp;
+	bool hit = hit_unbounded(ray, hit_obj, hitRec);   //first: a plane in front of the tree prunes the traversal
+	if (wide_nodes.empty()) return hit;
+	return (quantized ? traverse_closest(quantized_nodes, ray, hit_obj, hitRec) : traverse_closest(wide_nodes, ray, hit_obj, hitRec)) || hit;
+}
+
+// Closest hit traversal of the 4-wide nodes, for either of the node formats
+template <class Node>
+bool BVH::traverse_closest(const vector<Node>& tree, Ray& ray, const Object** hit_obj, HitRecord& hitRec) const {
 			bool hit = false;
-			stack<StackItem> hit_stack;
-			HitRecord rec;   //rec.isHit initialized to false and rec.t initialized with FLT_MAX
+			StackItem fixed_stack[TraversalStackSize];
+			vector<StackItem> heap_stack;   //only for a tree too deep for the fixed array
+			StackItem* hit_stack = traversal_stack(fixed_stack, heap_stack);
+			int stack_top = 0;
+			__m128 origin[3], inv_dir[3];
+			int sign[3];
+			for (int axis = 0; axis < 3; axis++) {
+				float inv = 1.0f / ray.direction.getAxisValue(axis);
+				origin[axis] = _mm_set1_ps(ray.origin.getAxisValue(axis));
+				inv_dir[axis] = _mm_set1_ps(inv);
+				sign[axis] = inv < 0.0f;
+			}
+
+			hit_stack[stack_top++] = StackItem(0, 0.0f);
+
+			while (stack_top > 0) {
+				StackItem current = hit_stack[--stack_top];
+				if (current.t > ray.tmax) continue;   //a closer hit was found after the node was pushed
+
+				const Node& currentNode = tree[current.index];
+				float t[4];
+				int mask = currentNode.hit(origin, inv_dir, sign, ray.tmin, ray.tmax, t);
 
-			BVHNode* currentNode = nodes[0];
+				//sort the children hit from near to far
+				int order[4], n_hit = 0;
+				for (int i = 0; i < 4; i++) {
+					if (!(mask & (1 << i))) continue;
+					int j = n_hit++;
+					for (; j > 0 && t[order[j - 1]] > t[i]; j--)
+						order[j] = order[j - 1];
+					order[j] = i;
+				}
 
-			//PUT YOUR CODE HERE
+				//leaves are intersected right away, near to far
+				for (int k = 0; k < n_hit; k++) {
+					int i = order[k];
+					if (currentNode.n_objs[i] == 0 || t[i] > ray.tmax) continue;
+
+					if (hit_leaf(currentNode.child[i], currentNode.n_objs[i], ray, hit_obj, hitRec))
+						hit = true;
+				}
+
+				//interior children are pushed far to near, so the nearest one is popped first
+				for (int k = n_hit - 1; k >= 0; k--) {
+					int i = order[k];
+					if (currentNode.n_objs[i] == 0 && t[i] <= ray.tmax)
+						hit_stack[stack_top++] = StackItem(currentNode.child[i], t[i]);
+				}
+			}
 
 			return hit;
 
 	}
 
-bool BVH::Traverse(Ray& ray) const {  //shadow ray with length
-			float tmp;
-			stack<StackItem> hit_stack;
-			HitRecord rec;
+bool BVH::Traverse(Ray& ray) const {
+	for (PrimId id : unbounded)
+		if (primitives->Occludes(id, ray))
+			return true;
+	if (wide_nodes.empty()) return false;
+	return quantized ? traverse_any(quantized_nodes, ray) : traverse_any(wide_nodes, ray);
+}
+
+// Any hit traversal for shadow rays: stops at the first object that blocks the ray within its interval, so
+// neither the children nor the hits need to be sorted
+template <class Node>
+bool BVH::traverse_any(const vector<Node>& tree, Ray& ray) const {
+	int fixed_stack[TraversalStackSize];
+	vector<int> heap_stack;   //only for a tree too deep for the fixed array
+	int* hit_stack = traversal_stack(fixed_stack, heap_stack);
+	int stack_top = 0;
+
+	__m128 origin[3], inv_dir[3];
+	int sign[3];
+	for (int axis = 0; axis < 3; axis++) {
+		float inv = 1.0f / ray.direction.getAxisValue(axis);
+		origin[axis] = _mm_set1_ps(ray.origin.getAxisValue(axis));
+		inv_dir[axis] = _mm_set1_ps(inv);
+		sign[axis] = inv < 0.0f;
+	}
+
+	hit_stack[stack_top++] = 0;
+
+	while (stack_top > 0) {
+		const Node& currentNode = tree[hit_stack[--stack_top]];
+		float t[4];
+		int mask = currentNode.hit(origin, inv_dir, sign, ray.tmin, ray.tmax, t);
+
+		for (int i = 0; i < 4; i++) {
+			if (!(mask & (1 << i))) continue;
+			if (currentNode.n_objs[i] == 0)
+				hit_stack[stack_top++] = currentNode.child[i];
+			else if (occludes_leaf(currentNode.child[i], currentNode.n_objs[i], ray))
+				return true;
+		}
+	}
+
+	return false;  //no primitive intersection
+}
+
+int BVH::TraversePacket(Ray* rays, int n_rays, const Object** hit_objs, HitRecord* hitRecs) const {
+	int hit_mask = 0;
+	for (int r = 0; r < n_rays && !unbounded.empty(); r++)
+		if (hit_unbounded(rays[r], &hit_objs[r], hitRecs[r]))
+			hit_mask |= 1 << r;
+	if (wide_nodes.empty()) return hit_mask;
+	return (quantized ? traverse_packet(quantized_nodes, rays, n_rays, hit_objs, hitRecs) : traverse_packet(wide_nodes, rays, n_rays, hit_objs, hitRecs)) | hit_mask;
+}
+
+// Closest hit traversal of a packet of up to MaxPacketSize rays. Each stack entry carries the mask of
+// the rays still active in that subtree. A node's boxes are decoded once for the whole packet, which is
+// first tested against them with interval arithmetic; only the boxes it may hit get tested ray by ray.
+// Children are visited near to far by the nearest entry of their rays
+template <class Node>
+int BVH::traverse_packet(const vector<Node>& tree, Ray* rays, int n_rays, const Object** hit_objs, HitRecord* hitRecs) const {
+	PacketItem fixed_stack[TraversalStackSize];
+	vector<PacketItem> heap_stack;   //only for a tree too deep for the fixed array
+	PacketItem* hit_stack = traversal_stack(fixed_stack, heap_stack);
+	int stack_top = 0;
+	int hit_mask = 0;
+
+	__m128 origin[MaxPacketSize][3], inv_dir[MaxPacketSize][3];
+	int sign[MaxPacketSize][3];
+	__m128 origin_lo[3], origin_hi[3], inv_lo[3], inv_hi[3];
+	bool coherent = true;   //the interval test needs directions with the same signs and finite inverses
+
+	for (int axis = 0; axis < 3; axis++) {
+		float o_lo = FLT_MAX, o_hi = -FLT_MAX, i_lo = FLT_MAX, i_hi = -FLT_MAX;
+		for (int r = 0; r < n_rays; r++) {
+			float o = rays[r].origin.getAxisValue(axis);
+			float inv = 1.0f / rays[r].direction.getAxisValue(axis);
+			origin[r][axis] = _mm_set1_ps(o);
+			inv_dir[r][axis] = _mm_set1_ps(inv);
+			sign[r][axis] = inv < 0.0f;
+			coherent = coherent && sign[r][axis] == sign[0][axis] && fabs(inv) <= FLT_MAX;
+			o_lo = MIN(o_lo, o); o_hi = MAX(o_hi, o);
+			i_lo = MIN(i_lo, inv); i_hi = MAX(i_hi, inv);
+		}
+		origin_lo[axis] = _mm_set1_ps(o_lo); origin_hi[axis] = _mm_set1_ps(o_hi);
+		inv_lo[axis] = _mm_set1_ps(i_lo); inv_hi[axis] = _mm_set1_ps(i_hi);
+	}
+
+	hit_stack[stack_top].index = 0;
+	hit_stack[stack_top++].active = (1u << n_rays) - 1;
 
-			double length = ray.direction.length(); //distance between light and intersection point
-			ray.direction.normalize();
+	while (stack_top > 0) {
+		PacketItem current = hit_stack[--stack_top];
+		const Node& currentNode = tree[current.index];
+		__m128 bounds[2][3];
+		currentNode.bounds(bounds);
 
+		int child_mask = 0xF;
+		if (coherent) {
+			float t_min = FLT_MAX, t_max = 0.0f;   //union of the intervals of the active rays
+			for (int r = 0; r < n_rays; r++)
+				if (current.active & (1u << r)) {
+					t_min = MIN(t_min, rays[r].tmin);
+					t_max = MAX(t_max, rays[r].tmax);
+				}
+			child_mask = hit4_interval(bounds, origin_lo, origin_hi, inv_lo, inv_hi, sign[0], t_min, t_max);
+			if (child_mask == 0) continue;
+		}
+
+		unsigned int child_rays[4] = { 0, 0, 0, 0 };
+		float child_t[4] = { FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX };
+		for (int r = 0; r < n_rays; r++) {
+			if (!(current.active & (1u << r))) continue;
+			float t[4];
+			int mask = hit4(bounds, origin[r], inv_dir[r], sign[r], rays[r].tmin, rays[r].tmax, t) & child_mask;
+			for (int i = 0; i < 4; i++)
+				if (mask & (1 << i)) {
+					child_rays[i] |= 1u << r;
+					child_t[i] = MIN(child_t[i], t[i]);
+				}
+		}
 
-			return false;  //no primitive intersection
+		//sort the children hit from near to far
+		int order[4], n_hit = 0;
+		for (int i = 0; i < 4; i++) {
+			if (child_rays[i] == 0) continue;
+			int j = n_hit++;
+			for (; j > 0 && child_t[order[j - 1]] > child_t[i]; j--)
+				order[j] = order[j - 1];
+			order[j] = i;
+		}
+
+		//leaves are intersected right away by their rays, near to far
+		for (int k = 0; k < n_hit; k++) {
+			int i = order[k];
+			if (currentNode.n_objs[i] == 0) continue;
 
+			for (int r = 0; r < n_rays; r++) {
+				if (!(child_rays[i] & (1u << r))) continue;
+				if (hit_leaf(currentNode.child[i], currentNode.n_objs[i], rays[r], &hit_objs[r], hitRecs[r]))
+					hit_mask |= 1 << r;
+			}
+		}
+
+		//interior children are pushed far to near, so the nearest one is popped first
+		for (int k = n_hit - 1; k >= 0; k--) {
+			int i = order[k];
+			if (currentNode.n_objs[i] != 0) continue;
+			hit_stack[stack_top].index = currentNode.child[i];
+			hit_stack[stack_top++].active = child_rays[i];
+		}
 	}
+
+	return hit_mask;
+}
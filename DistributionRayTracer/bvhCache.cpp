@@ -0,0 +1,284 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include "rayAccelerator.h"
+#include "macros.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+/****************************************************************************************************
+BVH cache: the flattened nodes, the 4-wide nodes and the order of the objects in the leaves (as indices
+into the scene's objects) are saved to a file next to the scene. The unbounded objects aren't in the tree,
+so they are just picked again from the scene's objects on load. The file carries a key hashing the
+geometry and the build parameters, so a stale or foreign file is just ignored and rebuilt.
+
+File layout: CacheHeader, nodes, wide nodes, object indices; each section starts at a multiple of 64.
+*****************************************************************************************************/
+
+static const char CacheMagic[8] = { 'P', '3', 'D', 'B', 'V', 'H', 0, 0 };
+static const unsigned int CacheVersion = 2;   //2: planes left out of the tree
+
+struct CacheHeader {
+	char magic[8];
+	unsigned int version;
+	unsigned int node_size, wide_node_size;
+	unsigned int n_nodes, n_wide_nodes, n_refs;
+	unsigned long long key;
+};
+
+static size_t align64(size_t offset) { return (offset + 63) & ~(size_t)63; }
+
+// Read-only mapping of a whole file
+class MappedFile {
+public:
+	const char* data = NULL;
+	size_t size = 0;
+
+	bool open(const char* path) {
+#ifdef _WIN32
+		file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) return false;
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping == NULL) return false;
+		data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		size = (size_t)file_size.QuadPart;
+#else
+		fd = ::open(path, O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0) return false;
+		void* ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (ptr == MAP_FAILED) return false;
+		data = (const char*)ptr;
+		size = st.st_size;
+#endif
+		return data != NULL;
+	}
+
+	~MappedFile() {
+#ifdef _WIN32
+		if (data) UnmapViewOfFile(data);
+		if (mapping) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+		if (data) munmap((void*)data, size);
+		if (fd >= 0) ::close(fd);
+#endif
+	}
+
+private:
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE, mapping = NULL;
+#else
+	int fd = -1;
+#endif
+};
+
+// FNV-1a hash of the build parameters and of the bounds of every object, which is all the SAH and LBVH
+// builders read. The SBVH also clips references against the actual geometry, so for it the bounds of
+// each object split at its center are hashed as well
+unsigned long long BVH::CacheKey(vector<PrimId>& objs) const {
+	unsigned long long hash = 14695981039346656037ULL;
+	auto mix = [&hash](const void* data, size_t size) {
+		for (size_t i = 0; i < size; i++) {
+			hash ^= ((const unsigned char*)data)[i];
+			hash *= 1099511628211ULL;
+		}
+	};
+	auto mix_bbox = [&mix](const AABB& bbox) {
+		float bounds[6] = { bbox.min.x, bbox.min.y, bbox.min.z, bbox.max.x, bbox.max.y, bbox.max.z };
+		mix(bounds, sizeof(bounds));
+	};
+
+	int int_params[] = { (int)builder, MaxLeafSize, NumBins, TreeletBits, LBVHLeafSize, (int)objs.size() };
+	float float_params[] = { TraversalCost, IntersectionCost, SBVHOverlapThreshold, SBVHDuplicationBudget };
+	mix(int_params, sizeof(int_params));
+	mix(float_params, sizeof(float_params));
+
+	for (PrimId id : objs) {
+		Object* obj = primitives->Get(id);
+		AABB bbox = obj->GetBoundingBox();
+		mix_bbox(bbox);
+		if (builder == SBVH_BUILD) {
+			for (int axis = 0; axis < 3; axis++) {
+				AABB left, right;
+				obj->SplitBoundingBox(bbox, axis, bbox.centroid().getAxisValue(axis), left, right);
+				mix_bbox(left);
+				mix_bbox(right);
+			}
+		}
+	}
+	return hash;
+}
+
+// Whether the nodes read from a cache file form a tree: every child comes after its parent, as the builder
+// stores them, and every leaf's objects are within the objects vector. A damaged file may still carry the
+// right key, and the traversals and the rest of Load index with these as read
+bool BVH::ValidTree(void) const {
+	size_t n_nodes = nodes.size(), n_wide_nodes = wide_nodes.size(), n_refs = objects.size();
+	if (n_wide_nodes == 0) return false;
+
+	for (size_t n = 0; n < n_nodes; n++) {
+		const BVHNode& node = nodes[n];
+		if (node.isLeaf()) {
+			if ((size_t)node.getIndex() + node.getNObjs() > n_refs) return false;
+		}
+		else if (node.getIndex() <= n + 1 || node.getIndex() >= n_nodes || node.getAxis() > 2)
+			return false;   //the first child is node n + 1, so the second one comes later
+	}
+
+	for (size_t n = 0; n < n_wide_nodes; n++)
+		for (int i = 0; i < 4; i++) {
+			int child = wide_nodes[n].child[i];
+			if (wide_nodes[n].n_objs[i] != 0) {
+				if (child < 0 || (size_t)child + wide_nodes[n].n_objs[i] > n_refs) return false;
+			}
+			else if (child != -1 && (child <= (int)n || (size_t)child >= n_wide_nodes))
+				return false;
+		}
+	return true;
+}
+
+// Loads the BVH of objs from the cache file. Returns false, leaving the BVH empty, if there is no
+// file or it doesn't match the objects and the build parameters
+bool BVH::Load(const char* path, vector<PrimId>& objs) {
+	auto timeStart = std::chrono::high_resolution_clock::now();
+
+	MappedFile file;
+	if (!file.open(path) || file.size < sizeof(CacheHeader))
+		return false;
+
+	CacheHeader header;
+	memcpy(&header, file.data, sizeof(header));
+	if (memcmp(header.magic, CacheMagic, sizeof(CacheMagic)) != 0 || header.version != CacheVersion ||
+		header.node_size != sizeof(BVHNode) || header.wide_node_size != sizeof(BVH4Node) || header.n_nodes == 0)
+		return false;
+
+	size_t nodes_offset = align64(sizeof(CacheHeader));
+	size_t wide_nodes_offset = align64(nodes_offset + (size_t)header.n_nodes * sizeof(BVHNode));
+	size_t refs_offset = align64(wide_nodes_offset + (size_t)header.n_wide_nodes * sizeof(BVH4Node));
+	if (file.size != refs_offset + (size_t)header.n_refs * sizeof(unsigned int))
+		return false;
+
+	if (header.key != CacheKey(objs)) {
+		printf("BVH cache %s is stale\n", path);
+		return false;
+	}
+
+	const unsigned int* refs = (const unsigned int*)(file.data + refs_offset);
+	objects.resize(header.n_refs);
+	for (unsigned int i = 0; i < header.n_refs; i++) {
+		if (refs[i] >= objs.size()) {
+			objects.clear();
+			return false;
+		}
+		objects[i] = objs[refs[i]];
+	}
+
+	unbounded.clear();
+	for (PrimId id : objs)
+		if (!primitives->Get(id)->IsBounded())
+			unbounded.push_back(id);
+
+	const BVHNode* file_nodes = (const BVHNode*)(file.data + nodes_offset);
+	const BVH4Node* file_wide_nodes = (const BVH4Node*)(file.data + wide_nodes_offset);
+	nodes.assign(file_nodes, file_nodes + header.n_nodes);
+	wide_nodes.assign(file_wide_nodes, file_wide_nodes + header.n_wide_nodes);
+	if (!ValidTree()) {
+		printf("BVH cache %s is corrupt\n", path);
+		objects.clear();
+		nodes.clear();
+		wide_nodes.clear();
+		return false;
+	}
+	stack_size = traversal_stack_size();
+	if (quantized)
+		quantize();
+	build_leaf_blocks();
+	scene_objects = objs;
+	build_sah_cost = ComputeSAHCost();
+
+	auto timeEnd = std::chrono::high_resolution_clock::now();
+	printf("\nBVH loaded from %s: total nodes = %d, references = %d, load time = %.1f ms\n\n", path,
+		(int)nodes.size(), this->getNumObjects(), std::chrono::duration<double, std::milli>(timeEnd - timeStart).count());
+	return true;
+}
+
+// Saves the BVH built from objs to the cache file. The file is written under another name and then renamed
+// over the old one, so a run loading the cache meanwhile maps either the old file or the whole new one
+bool BVH::Save(const char* path, vector<PrimId>& objs) const {
+	if (nodes.empty()) return false;   //nothing but planes: no tree to save, and Load() only takes one with nodes
+
+	unordered_map<PrimId, unsigned int> index_of;
+	for (size_t i = 0; i < objs.size(); i++)
+		index_of[objs[i]] = i;
+
+	vector<unsigned int> refs(objects.size());
+	for (size_t i = 0; i < objects.size(); i++)
+		refs[i] = index_of[objects[i]];
+
+	CacheHeader header;
+	memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+	header.version = CacheVersion;
+	header.node_size = sizeof(BVHNode);
+	header.wide_node_size = sizeof(BVH4Node);
+	header.n_nodes = nodes.size();
+	header.n_wide_nodes = wide_nodes.size();
+	header.n_refs = refs.size();
+	header.key = CacheKey(objs);
+
+	char tmp_path[FILENAME_MAX];
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+		printf("Cannot write the BVH cache %s\n", path);
+		return false;
+	}
+	FILE* file = fopen(tmp_path, "wb");
+	if (file == NULL) {
+		printf("Cannot write the BVH cache %s\n", path);
+		return false;
+	}
+
+	static const char padding[64] = { 0 };
+	size_t offset = 0;
+	auto write = [&](const void* data, size_t size) {
+		fwrite(data, 1, size, file);
+		offset += size;
+	};
+	auto align = [&]() { write(padding, align64(offset) - offset); };
+
+	write(&header, sizeof(header));
+	align();
+	write(nodes.data(), nodes.size() * sizeof(BVHNode));
+	align();
+	write(wide_nodes.data(), wide_nodes.size() * sizeof(BVH4Node));
+	align();
+	write(refs.data(), refs.size() * sizeof(unsigned int));
+
+	bool ok = !ferror(file);
+	ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+	ok = ok && MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING);   //rename() doesn't replace a file on Windows
+#else
+	ok = ok && rename(tmp_path, path) == 0;
+#endif
+	if (!ok) {
+		remove(tmp_path);
+		printf("Cannot write the BVH cache %s\n", path);
+		return false;
+	}
+	return true;
+}
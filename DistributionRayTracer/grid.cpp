@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include "rayAccelerator.h"
 #include "macros.h"
 
@@ -10,10 +13,10 @@ int Grid::getNumObjects() const
 }
 
 
-void Grid::setAABB(AABB& bbox_) { this->bbox = bbox_; }
+void Grid::setAABB(AABB& bbox_) { top.bbox = bbox_; }
 
 
-void Grid::addObject(Object* o)
+void Grid::addObject(PrimId o)
 {
 	objects.push_back(o);
 }
@@ -22,12 +25,12 @@ void Grid::addObject(Object* o)
 Object* Grid::getObject(unsigned int index) const
 {
 	if (index >= 0 && index < objects.size())
-		return objects[index];
+		return primitives->Get(objects[index]);
 	return NULL;
 }
 
 // ---------------------------------------------setup_cells
-void Grid::Build(vector<Object*>& objs) {
+void Grid::Build(vector<PrimId>& objs) {
 
 	int xmin, xmax;
 	int ymin, ymax;
@@ -38,13 +41,21 @@ void Grid::Build(vector<Object*>& objs) {
 	Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
 
 	AABB grid_bbox = AABB(min, max);
-
-	//build the Grid BB and //insert scene objects in the Grid objects list
-	for (Object* obj : objs) {
-		AABB o_bbox = obj->GetBoundingBox();
+	auto timeStart = std::chrono::high_resolution_clock::now();
+
+	//build the Grid BB and //insert scene objects in the Grid objects list; planes stay out of the cells
+	unbounded.clear();
+	for (PrimId obj : objs) {
+		if (!primitives->Get(obj)->IsBounded()) {
+			unbounded.push_back(obj);
+			continue;
+		}
+		AABB o_bbox = primitives->Get(obj)->GetBoundingBox();
 		grid_bbox.extend(o_bbox);
 		this->addObject(obj);
 	}
+	if (this->getNumObjects() == 0)   //nothing but planes: a single empty cell
+		grid_bbox = AABB(Vector(0.0f, 0.0f, 0.0f), Vector(0.0f, 0.0f, 0.0f));
 	//slightly enlarge the grid box just for case
 	grid_bbox.min.x -= EPSILON; grid_bbox.min.y -= EPSILON; grid_bbox.min.z -= EPSILON;
 	grid_bbox.max.x += EPSILON; grid_bbox.max.y += EPSILON; grid_bbox.max.z += EPSILON;
@@ -53,53 +64,207 @@ void Grid::Build(vector<Object*>& objs) {
 
 
 	// dimensions of the grid in the x, y, and z directions
-	double wx = bbox.max.x - bbox.min.x;
-	double wy = bbox.max.y - bbox.min.y;
-	double wz = bbox.max.z - bbox.min.z;
+	double wx = top.bbox.max.x - top.bbox.min.x;
+	double wy = top.bbox.max.y - top.bbox.min.y;
+	double wz = top.bbox.max.z - top.bbox.min.z;
 
 	// compute the number of grid cells in the x, y, and z directions
 	double s = pow(this->getNumObjects() / (wx * wy * wz), 0.3333333);  //number of objects per unit of length
 
-	nx = m * wx * s + 1;
-	ny = m * wy * s + 1;
-	nz = m * wz * s + 1;
-
-	int cellCount = nx * ny * nz;
+	top.nx = m * wx * s + 1;
+	top.ny = m * wy * s + 1;
+	top.nz = m * wz * s + 1;
+
+	int cellCount = top.nx * top.ny * top.nz;
+
+	cell_offsets.assign(1, 0);
+	cell_objects.clear();
+	cell_shared.clear();
+	cell_indices.clear();
+	n_indices = objects.size();
+	vector<unsigned int> indices(n_indices);
+	for (unsigned int o = 0; o < n_indices; o++)
+		indices[o] = o;
+	vector<unsigned char> shared(n_indices, 0);
+	fill_cells(top, objects, indices, shared);
+
+	//two-level grid: each cell with more than SubGridObjects objects gets a grid of its own over its box, about
+	//one cell per object (sub_m). Their cells follow the top level's in cell_offsets
+	sub_grids.clear();
+	cell_sub_grid.assign(cellCount, -1);
+	if (two_level) {
+		Vector cell_size = Vector((top.bbox.max.x - top.bbox.min.x) / top.nx, (top.bbox.max.y - top.bbox.min.y) / top.ny,
+			(top.bbox.max.z - top.bbox.min.z) / top.nz);
+		for (int i = 0; i < cellCount; i++) {
+			int n_objs = cell_offsets[i + 1] - cell_offsets[i];
+			if (n_objs <= SubGridObjects) continue;
+
+			int ix = i % top.nx, iy = (i / top.nx) % top.ny, iz = i / (top.nx * top.ny);
+			Level sub;
+			sub.bbox.min = top.bbox.min + Vector(ix * cell_size.x, iy * cell_size.y, iz * cell_size.z);
+			sub.bbox.max = top.bbox.min + Vector((ix + 1) * cell_size.x, (iy + 1) * cell_size.y, (iz + 1) * cell_size.z);
+			double sub_s = pow(n_objs / ((double)cell_size.x * cell_size.y * cell_size.z), 0.3333333);
+			sub.nx = sub_m * cell_size.x * sub_s + 1;
+			sub.ny = sub_m * cell_size.y * sub_s + 1;
+			sub.nz = sub_m * cell_size.z * sub_s + 1;
+
+			//an object in other top cells stays shared, whatever the cells of the sub-grid it falls in
+			vector<PrimId> objs_of_cell(cell_objects.begin() + cell_offsets[i], cell_objects.begin() + cell_offsets[i + 1]);
+			vector<unsigned int> indices_of_cell(cell_indices.begin() + cell_offsets[i], cell_indices.begin() + cell_offsets[i + 1]);
+			vector<unsigned char> shared_of_cell(n_objs, 0);
+			fill(shared_of_cell.begin() + (cell_shared[i] - cell_offsets[i]), shared_of_cell.end(), 1);
+			fill_cells(sub, objs_of_cell, indices_of_cell, shared_of_cell);
+			cell_sub_grid[i] = sub_grids.size();
+			sub_grids.push_back(sub);
+		}
+	}
 
-	// set up a array to hold the objects stored in each cell
-	std::vector<Object*> obj_cell;
-	for (int i = 0; i < cellCount; i++)
-		cells.push_back(obj_cell);   //each cell has an array with zero elements
+	//the triangles or the spheres of each cell, in SIMD blocks. Cells split in a sub-grid are never visited
+	int totalCells = cell_offsets.size() - 1;
+	cell_packs.Clear();
+	cell_blocks.resize(totalCells);
+	for (int i = 0; i < totalCells; i++)
+		cell_blocks[i] = i < cellCount && cell_sub_grid[i] >= 0 ? -1 :
+			cell_packs.Add(*primitives, cell_objects.data() + cell_offsets[i], cell_offsets[i + 1] - cell_offsets[i]);
+
+	auto timeEnd = std::chrono::high_resolution_clock::now();
+	printf("\nGRID: total cells = %d, total objects = %d, unbounded objects = %d, references = %d, ResX = %d, ResY = %d, ResZ = %d, ",
+		cellCount, this->getNumObjects(), (int)unbounded.size(), (int)cell_objects.size(), top.nx, top.ny, top.nz);
+	if (two_level)
+		printf("sub-grids = %d, sub-grid cells = %d, ", (int)sub_grids.size(), totalCells - cellCount);
+	printf("build time = %.1f ms\n\n", std::chrono::duration<double, std::milli>(timeEnd - timeStart).count());
+	//Erase the vector that stores object pointers, but don't delete the objects
+	objects.erase(objects.begin(), objects.end());
+}
 
-	// insert the objects into the cells
-	for (auto &obj : objects) {   //vector iterator
+// Appends the cells of level, holding objs (of grid indices indices), to cell_offsets, cell_shared, cell_objects
+// and cell_indices; level.first_cell is set to the first of them. shared[o] is set for the objects in more than
+// one cell of the level, and may come set already from an upper level. The objects are inserted in two parallel
+// passes: count the objects of each cell, which gives where the cell starts in cell_objects, then write them
+// there. The counters are atomic, as many objects may share a cell; std::atomic rather than OMP atomics, which
+// can't fetch the old value in OpenMP 2.0
+void Grid::fill_cells(Level& level, const vector<PrimId>& objs, const vector<unsigned int>& indices, vector<unsigned char>& shared) {
+	int n_cells = level.nx * level.ny * level.nz, n_objects = objs.size();
+	bool parallel = n_objects > ParallelFillSize;   //the small sub-grids aren't worth a parallel region
+	const AABB& bbox = level.bbox;
+	int nx = level.nx, ny = level.ny, nz = level.nz;
+
+	// Compute indices of both cells that contain min and max coord of obj bbox
+	auto cell_range = [&](PrimId obj, int imin[3], int imax[3]) {
+		AABB obb = primitives->Get(obj)->GetBoundingBox();
+		imin[0] = clamp((obb.min.x - bbox.min.x) * nx / (bbox.max.x - bbox.min.x), 0, nx - 1);
+		imin[1] = clamp((obb.min.y - bbox.min.y) * ny / (bbox.max.y - bbox.min.y), 0, ny - 1);
+		imin[2] = clamp((obb.min.z - bbox.min.z) * nz / (bbox.max.z - bbox.min.z), 0, nz - 1);
+		imax[0] = clamp((obb.max.x - bbox.min.x) * nx / (bbox.max.x - bbox.min.x), 0, nx - 1);
+		imax[1] = clamp((obb.max.y - bbox.min.y) * ny / (bbox.max.y - bbox.min.y), 0, ny - 1);
+		imax[2] = clamp((obb.max.z - bbox.min.z) * nz / (bbox.max.z - bbox.min.z), 0, nz - 1);
+	};
+
+	vector<atomic<unsigned int> > counters(n_cells);   //value-initialized: zero
+	vector<int> ranges(6 * (size_t)n_objects);   //first and last cell of each object along x, y and z, for the second pass
+
+#pragma omp parallel for if (parallel)
+	for (int o = 0; o < n_objects; o++) {
+		int* imin = &ranges[6 * (size_t)o], * imax = imin + 3;
+		cell_range(objs[o], imin, imax);
+		if (imin[0] != imax[0] || imin[1] != imax[1] || imin[2] != imax[2])
+			shared[o] = 1;
+		for (int iz = imin[2]; iz <= imax[2]; iz++) 					// cells in z direction
+			for (int iy = imin[1]; iy <= imax[1]; iy++)					// cells in y direction
+				for (int ix = imin[0]; ix <= imax[0]; ix++) 			// cells in x direction
+					counters[ix + nx * iy + nx * ny * iz].fetch_add(1, memory_order_relaxed);
+	}
 
-		AABB obb = obj->GetBoundingBox();
+	//offsets relative to the first of the level's objects, whose offset is already the last of cell_offsets
+	level.first_cell = cell_offsets.size() - 1;
+	unsigned int start = cell_offsets.back();
+	vector<unsigned int> offsets(n_cells + 1);
+	offsets[0] = 0;
+	for (int i = 0; i < n_cells; i++) {
+		offsets[i + 1] = offsets[i] + counters[i].load(memory_order_relaxed);
+		counters[i].store(offsets[i], memory_order_relaxed);   //from now on, the next free slot of the cell
+	}
 
-		// Compute indices of both cells that contain min and max coord of obj bbox
-		int ixmin = clamp((obb.min.x - bbox.min.x) * nx / (bbox.max.x - bbox.min.x), 0, nx - 1);
-		int iymin = clamp((obb.min.y - bbox.min.y) * ny / (bbox.max.y - bbox.min.y), 0, ny - 1);
-		int izmin = clamp((obb.min.z - bbox.min.z) * nz / (bbox.max.z - bbox.min.z), 0, nz - 1);
-		int ixmax = clamp((obb.max.x - bbox.min.x) * nx / (bbox.max.x - bbox.min.x), 0, nx - 1);
-		int iymax = clamp((obb.max.y - bbox.min.y) * ny / (bbox.max.y - bbox.min.y), 0, ny - 1);
-		int izmax = clamp((obb.max.z - bbox.min.z) * nz / (bbox.max.z - bbox.min.z), 0, nz - 1);
+	vector<unsigned int> refs(offsets[n_cells]);   //indices into objs
+#pragma omp parallel for if (parallel)
+	for (int o = 0; o < n_objects; o++) {
+		const int* imin = &ranges[6 * (size_t)o], * imax = imin + 3;
+		for (int iz = imin[2]; iz <= imax[2]; iz++)
+			for (int iy = imin[1]; iy <= imax[1]; iy++)
+				for (int ix = imin[0]; ix <= imax[0]; ix++)
+					refs[counters[ix + nx * iy + nx * ny * iz].fetch_add(1, memory_order_relaxed)] = o;
+	}
 
-		// add the object to the cells
-		for (int iz = izmin; iz <= izmax; iz++) 					// cells in z direction
-			for (int iy = iymin; iy <= iymax; iy++)					// cells in y direction
-				for (int ix = ixmin; ix <= ixmax; ix++) 			// cells in x direction
-					cells[ix + nx * iy + nx * ny * iz].push_back(obj);
+	//the threads filled each cell in any order: sorting it back to the order of the objects, the ones in no
+	//other cell first, makes the cells, and so the ties between equal hits, the same on every build
+	cell_objects.resize(start + refs.size());
+	cell_indices.resize(start + refs.size());
+	cell_shared.resize(level.first_cell + n_cells);
+#pragma omp parallel for schedule(dynamic, 1024) if (parallel)
+	for (int i = 0; i < n_cells; i++) {
+		sort(refs.begin() + offsets[i], refs.begin() + offsets[i + 1],
+			[&shared](unsigned int a, unsigned int b) { return shared[a] != shared[b] ? shared[a] < shared[b] : a < b; });
+		unsigned int first_shared = offsets[i + 1];
+		for (unsigned int k = offsets[i]; k < offsets[i + 1]; k++) {
+			cell_objects[start + k] = objs[refs[k]];
+			cell_indices[start + k] = indices[refs[k]];
+			if (shared[refs[k]] && first_shared == offsets[i + 1])
+				first_shared = k;
+		}
+		cell_shared[level.first_cell + i] = start + first_shared;
 	}
 
-	printf("\nGRID: total cells = %d, total objects = %d, ResX = %d, ResY = %d, ResZ = %d\n\n", cellCount, this->getNumObjects(), nx, ny, nz);
-	//Erase the vector that stores object pointers, but don't delete the objects
-	objects.erase(objects.begin(), objects.end());
+	cell_offsets.resize(level.first_cell + n_cells + 1);
+	for (int i = 1; i <= n_cells; i++)
+		cell_offsets[level.first_cell + i] = start + offsets[i];
+	empty_distances(level);
+}
+
+// Sets cell_empty for the cells of level: 0 for the cells with objects, then two raster passes, forward and
+// backward, each lowering a cell to one more than the lowest of its 13 neighbours already passed. With all 26
+// neighbours one step away, that's the exact Chebyshev distance
+void Grid::empty_distances(const Level& level) {
+	static const int half[13][3] = { { -1, -1, -1 }, { 0, -1, -1 }, { 1, -1, -1 }, { -1, 0, -1 }, { 0, 0, -1 }, { 1, 0, -1 },
+		{ -1, 1, -1 }, { 0, 1, -1 }, { 1, 1, -1 }, { -1, -1, 0 }, { 0, -1, 0 }, { 1, -1, 0 }, { -1, 0, 0 } };
+	int nx = level.nx, ny = level.ny, nz = level.nz, n_cells = nx * ny * nz;
+	int step[13];   //offset of each neighbour in the cell array
+	for (int k = 0; k < 13; k++)
+		step[k] = half[k][0] + nx * half[k][1] + nx * ny * half[k][2];
+
+	cell_empty.resize(level.first_cell + n_cells);
+	unsigned char* dist = cell_empty.data() + level.first_cell;
+	const unsigned int* offsets = cell_offsets.data() + level.first_cell;
+	for (int i = 0; i < n_cells; i++)
+		dist[i] = offsets[i + 1] == offsets[i] ? 255 : 0;
+
+	for (int s = 1; s >= -1; s -= 2) {   //the backward pass takes the mirrored neighbours
+		for (int kz = 0; kz < nz; kz++)
+			for (int ky = 0; ky < ny; ky++)
+				for (int kx = 0; kx < nx; kx++) {
+					int ix = s > 0 ? kx : nx - 1 - kx, iy = s > 0 ? ky : ny - 1 - ky, iz = s > 0 ? kz : nz - 1 - kz;
+					int i = ix + nx * iy + nx * ny * iz;
+					int d = dist[i];
+					if (d == 0) continue;
+					if (ix > 0 && ix < nx - 1 && iy > 0 && iy < ny - 1 && iz > 0 && iz < nz - 1)   //all neighbours in the grid
+						for (int k = 0; k < 13; k++)
+							d = min(d, dist[i + s * step[k]] + 1);
+					else
+						for (const int* o : half) {
+							int jx = ix + s * o[0], jy = iy + s * o[1], jz = iz + s * o[2];
+							if (jx < 0 || jx >= nx || jy < 0 || jy >= ny || jz < 0 || jz >= nz) continue;
+							d = min(d, dist[jx + nx * jy + nx * ny * jz] + 1);
+						}
+					dist[i] = d;
+				}
+	}
 }
 
 //Setup function for Grid traversal according to Amanatides&Woo algorithm
-bool Grid::Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, double& dty, double& dtz,
+bool Grid::Init_Traverse(const Level& level, Ray& ray, int& ix, int& iy, int& iz, double& dtx, double& dty, double& dtz,
 		double& tx_next, double& ty_next, double& tz_next, int& ix_step, int& iy_step, int& iz_step, int& ix_stop, int& iy_stop, int& iz_stop) const {
 
+	const AABB& bbox = level.bbox;
+	int nx = level.nx, ny = level.ny, nz = level.nz;
 
 	float t0, t1; //entering and leaving points
 
@@ -167,7 +332,9 @@ bool Grid::Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, doubl
 	if (tz_max < t1)
 		t1 = tz_max;
 
-	if (t0 > t1 || t1 < 0)   //crossover: ray does not intersect the Grid bounding box OR leaving point is behind the ray origin
+	//crossover: ray does not intersect the Grid bounding box OR the box is outside the ray's interval. A NaN bound,
+	//from a zero direction component with the origin on the box's face, counts as a miss too
+	if (!(t0 <= t1) || t1 < ray.tmin || t0 > ray.tmax)
 		return(false);
 
 
@@ -243,8 +410,12 @@ bool Grid::Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, doubl
 	return true;
 }
 
-//-----------------------------------------------------------------------GRID TRAVERSAL
-bool Grid::Traverse(Ray& ray, const Object **hitobject, HitRecord& hitRec) const {
+// Walks the cells of level crossed by the ray, near to far, calling visit(cell) with the index of each one in
+// cell_offsets, until visit returns true or the next cell starts past ray.tmax, which visit may lower.
+// Returns true if visit did. Empty space is crossed in jumps: from a cell at a distance d of the nearest
+// cell with objects, the ray goes straight to the last cell it crosses in the empty cube of cells within d - 1
+template <class Visit>
+bool Grid::walk(const Level& level, Ray& ray, Visit& visit) const {
 	int ix, iy, iz;
 	double 	tx_next, ty_next, tz_next;
 	double dtx, dty, dtz;
@@ -253,106 +424,169 @@ bool Grid::Traverse(Ray& ray, const Object **hitobject, HitRecord& hitRec) const
 	int 	ix_stop, iy_stop, iz_stop;
 
 	//Calculate the initial cell as well as the ray parameter increments per cell in the x, y, and z directions
-	if (!Init_Traverse(ray, ix, iy, iz, dtx, dty, dtz, tx_next, ty_next, tz_next, ix_step, iy_step, iz_step, ix_stop, iy_stop, iz_stop))
-		return false;   //ray does not intersect the Grid bounding box
-
-	std::vector<Object*> objs;
-	Object* closestObj = NULL;
-	HitRecord rec;
+	if (!Init_Traverse(level, ray, ix, iy, iz, dtx, dty, dtz, tx_next, ty_next, tz_next, ix_step, iy_step, iz_step, ix_stop, iy_stop, iz_stop))
+		return false;   //ray does not intersect the level's bounding box
 
 	while (true) {
-		objs = cells[ix + nx * iy + nx * ny * iz];
-
-		if (objs.size() != 0)
-			for (auto obj : objs) { //intersect Ray with all objects and find the closest hit point(if any)
-				rec = obj->hit(ray);
-				if (rec.isHit && rec.t < hitRec.t) {   //hitRec.t initialized with FLT_MAX
-					hitRec.t = rec.t;
-					hitRec.isHit = true;
-					hitRec.normal = rec.normal;
-					closestObj = obj;
-				}
-			}
+		int cell = level.first_cell + ix + level.nx * iy + level.nx * level.ny * iz;
+		int empty = cell_empty[cell];
+		if (empty > 1) {
+			//the ray leaves the cube where it first leaves one of its slabs; the cells it crosses before
+			//that are found by counting the cell boundaries of each axis it passes up to there
+			double t_skip = FLT_MAX;
+			if (tx_next < FLT_MAX) t_skip = min(t_skip, tx_next + (empty - 1) * dtx);
+			if (ty_next < FLT_MAX) t_skip = min(t_skip, ty_next + (empty - 1) * dty);
+			if (tz_next < FLT_MAX) t_skip = min(t_skip, tz_next + (empty - 1) * dtz);
+			if (t_skip >= ray.tmax) return false;   //the rest of the ray's interval is in empty cells
+
+			auto jump = [&](double& t_next, double dt, int& i, int step) {
+				if (t_next >= t_skip) return;
+				int n = min((int)ceil((t_skip - t_next) / dt), empty - 1);   //the cube's last cell at most
+				t_next += n * dt;
+				i += n * step;
+			};
+			jump(tx_next, dtx, ix, ix_step);
+			jump(ty_next, dty, iy, iy_step);
+			jump(tz_next, dtz, iz, iz_step);
+			if (ix < 0 || ix >= level.nx || iy < 0 || iy >= level.ny || iz < 0 || iz >= level.nz)
+				return false;   //the cube reaches out of the grid
+			continue;
+		}
+		if (visit(cell))
+			return true;
 
 		if (tx_next < ty_next && tx_next < tz_next) {
-			if (hitRec.t < tx_next) {
-					*hitobject = closestObj;
-					return true;
-			}
+			if (ray.tmax < tx_next) return false;   //nothing closer can be in the next cells
 			tx_next += dtx;
 			ix += ix_step;
-			if (ix == ix_stop) return (false);
+			if (ix == ix_stop) return false;
 		}
-
 		else if (ty_next < tz_next) {
-				if (hitRec.t < ty_next) {
-					*hitobject = closestObj;
-					return true;
-				}
-				ty_next += dty;
-				iy += iy_step;
-				if (iy == iy_stop) return (false);
+			if (ray.tmax < ty_next) return false;
+			ty_next += dty;
+			iy += iy_step;
+			if (iy == iy_stop) return false;
 		}
 		else {
-			if (hitRec.t < tz_next) {
-				*hitobject = closestObj;
-				return true;
-			}
+			if (ray.tmax < tz_next) return false;
 			tz_next += dtz;
 			iz += iz_step;
-			if (iz == iz_stop) return (false);
+			if (iz == iz_stop) return false;
 		}
 	}
 }
 
-//-----------------------------------------------------------------------GRID TRAVERSAL FOR SHADOW RAY
-bool Grid::Traverse(Ray& ray) const {
-
-	double length = ray.direction.length(); //distance between light and intersection point
-	ray.direction.normalize();
-
-	int ix, iy, iz;
-	double 	tx_next, ty_next, tz_next;
-	double dtx, dty, dtz;
-
-	int 	ix_step, iy_step, iz_step;
-	int 	ix_stop, iy_stop, iz_stop;
+//stamps of the rays traced by each thread: the last stamp given, and the one of the last ray to test each object
+struct MailboxStamps {
+	vector<unsigned int> stamps;
+	unsigned int ray = 0;
+};
+static thread_local MailboxStamps mailbox_stamps;
+
+Grid::Mailbox::Mailbox(unsigned int n_indices) {
+	MailboxStamps& thread = mailbox_stamps;
+	if (++thread.ray == 0) {   //wrapped around: the stamps of old rays would match again
+		fill(thread.stamps.begin(), thread.stamps.end(), 0);
+		thread.ray = 1;
+	}
+	if (thread.stamps.size() < n_indices)   //grids of any size share the array, each stamp being used once
+		thread.stamps.resize(n_indices, 0);
+	stamps = thread.stamps.data();
+	ray = thread.ray;
+}
 
-	/*Calculate the initial cell as well as the ray parameter increments per cell in the x, y, and z directions
-	Shadow ray always intersect the Grid bounding box. However due to rounding it may starts at the boundaries, which may result as no intersecting. Consider it as in shadow. */
-	if (!Init_Traverse(ray, ix, iy, iz, dtx, dty, dtz, tx_next, ty_next, tz_next, ix_step, iy_step, iz_step, ix_stop, iy_stop, iz_stop))
-		return true;
+const unsigned char* Grid::Mailbox::untested_lanes(const unsigned int* indices, int n_local, int n_objs) {
+	int width = LeafBlocks::Width(), n_blocks = (n_objs + width - 1) / width;
+	unsigned char* lanes = fixed_lanes;
+	if (n_blocks > FixedLanes) {
+		heap_lanes.resize(n_blocks);
+		lanes = heap_lanes.data();
+	}
+	fill(lanes, lanes + n_blocks, 0);
+	for (int j = 0; j < n_objs; j++)
+		if (j < n_local || !tested(indices[j]))
+			lanes[j / width] |= 1 << (j % width);
+	return lanes;
+}
 
-	std::vector<Object*> objs;
+//-----------------------------------------------------------------------GRID TRAVERSAL
+bool Grid::Traverse(Ray& ray, const Object **hitobject, HitRecord& hitRec) const {
+	const Object* closestObj = NULL;
 	HitRecord rec;
 
-	while (true) {
-		objs = cells[ix + nx * iy + nx * ny * iz];
-		if (objs.size() != 0)
-			//intersect Ray with all objects of each cell
-			for (auto &obj : objs) {
-				rec = obj->hit(ray);
-				if ( rec.isHit && rec.t < length)
-					return true;
-			}
-
-		if (tx_next < ty_next && tx_next < tz_next) {
-			tx_next += dtx;
-			ix += ix_step;
-			if (ix == ix_stop) return (false);
+	//the planes first: a hit lowers ray.tmax, so the walk stops at the cell holding it
+	for (PrimId obj : unbounded) {
+		rec = primitives->Hit(obj, ray);
+		if (rec.isHit) {
+			ray.tmax = rec.t;
+			hitRec = rec;
+			closestObj = primitives->Get(obj);
 		}
-		else {
-			if (ty_next < tz_next) {
+	}
 
-				ty_next += dty;
-				iy += iy_step;
-				if (iy == iy_stop) return (false);
-			}
-			else {
-				tz_next += dtz;
-				iz += iz_step;
-				if (iz == iz_stop) return (false);
+	//intersect Ray with all objects of a cell and find the closest hit point(if any)
+	Mailbox mailbox(n_indices);
+	auto hit_cell = [&](int cell) {
+		const PrimId* objs = cell_objects.data() + cell_offsets[cell];
+		const unsigned int* indices = cell_indices.data() + cell_offsets[cell];
+		int n_local = cell_shared[cell] - cell_offsets[cell], n_objs = cell_offsets[cell + 1] - cell_offsets[cell];
+
+		if (cell_blocks[cell] != -1) {   //a cell of triangles or of spheres: tested a block at a time
+			const unsigned char* lanes = n_local < n_objs ? mailbox.untested_lanes(indices, n_local, n_objs) : NULL;
+			int j = cell_packs.Hit(cell_blocks[cell], n_objs, ray, hitRec, lanes);
+			if (j >= 0) {
+				ray.tmax = hitRec.t;
+				closestObj = primitives->Get(objs[j]);
 			}
 		}
-	}
+		else
+			for (int j = 0; j < n_objs; j++) {
+				PrimId obj = objs[j];
+				if (j >= n_local && mailbox.tested(indices[j])) continue;   //a hit of it already lowered ray.tmax
+				rec = primitives->Hit(obj, ray);
+				if (rec.isHit) {   //within the ray's interval, so closer than any previous hit
+					ray.tmax = rec.t;
+					hitRec = rec;
+					closestObj = primitives->Get(obj);
+				}
+			}
+		return false;   //the walk goes on until the next cell is past the closest hit
+	};
+	auto visit = [&](int cell) {
+		if (cell_sub_grid[cell] >= 0)
+			walk(sub_grids[cell_sub_grid[cell]], ray, hit_cell);
+		else
+			hit_cell(cell);
+		return false;
+	};
+	walk(top, ray, visit);
+
+	*hitobject = closestObj;
+	return closestObj != NULL;
+}
+
+//-----------------------------------------------------------------------GRID TRAVERSAL FOR SHADOW RAY
+// Any hit within the ray's interval: stops at the first blocking object, or at the first cell beyond it
+bool Grid::Traverse(Ray& ray) const {
+	for (PrimId obj : unbounded)
+		if (primitives->Occludes(obj, ray))
+			return true;
+
+	//intersect Ray with the objects of a cell until one blocks it
+	Mailbox mailbox(n_indices);
+	auto occludes_cell = [&](int cell) {
+		const PrimId* objs = cell_objects.data() + cell_offsets[cell];
+		const unsigned int* indices = cell_indices.data() + cell_offsets[cell];
+		int n_local = cell_shared[cell] - cell_offsets[cell], n_objs = cell_offsets[cell + 1] - cell_offsets[cell];
+		if (cell_blocks[cell] != -1)
+			return cell_packs.Occludes(cell_blocks[cell], n_objs, ray, n_local < n_objs ? mailbox.untested_lanes(indices, n_local, n_objs) : NULL);
+		for (int j = 0; j < n_objs; j++)
+			if ((j < n_local || !mailbox.tested(indices[j])) && primitives->Occludes(objs[j], ray))
+				return true;
+		return false;
+	};
+	auto visit = [&](int cell) {
+		return cell_sub_grid[cell] >= 0 ? walk(sub_grids[cell_sub_grid[cell]], ray, occludes_cell) : occludes_cell(cell);
+	};
+	return walk(top, ray, visit);
 }
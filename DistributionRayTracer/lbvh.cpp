@@ -0,0 +1,229 @@
+#include "rayAccelerator.h"
+#include "macros.h"
+
+using namespace std;
+
+/****************************************************************************************************
+LBVH builder (Lauterbach et al. 2009, with the HLBVH upper levels of Pantaleoni & Luebke 2010):
+objects are sorted along a Morton curve by their centroids, and the hierarchy is read directly from
+the bits of the sorted codes. Objects sharing the TreeletBits highest bits form a treelet; treelets
+are emitted in parallel and the few levels above them are built with the SAH to recover tree quality.
+*****************************************************************************************************/
+
+// Spreads the 10 lowest bits of v so that there are two zero bits between each of them
+static unsigned int expand_bits(unsigned int v) {
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// 30-bit Morton code of a point given in [0, 1]^3
+static unsigned int morton_code(float x, float y, float z) {
+	unsigned int ix = (unsigned int)MIN(MAX(x * 1024.0f, 0.0f), 1023.0f);
+	unsigned int iy = (unsigned int)MIN(MAX(y * 1024.0f, 0.0f), 1023.0f);
+	unsigned int iz = (unsigned int)MIN(MAX(z * 1024.0f, 0.0f), 1023.0f);
+	return (expand_bits(ix) << 2) | (expand_bits(iy) << 1) | expand_bits(iz);
+}
+
+// Parallel LSD radix sort of 30-bit keys (3 passes of 10 bits), carrying the object indices along.
+// The input is split in fixed blocks, each one with its own histogram, so the sort is stable and
+// gives the same order no matter how many threads run it.
+static void radix_sort(vector<unsigned int>& keys, vector<int>& values) {
+	const int bits_per_pass = 10;
+	const int n_buckets = 1 << bits_per_pass;
+	const int n = keys.size();
+	const int n_blocks = MAX(1, MIN(64, n / 16384));
+	const int block_size = (n + n_blocks - 1) / n_blocks;
+
+	vector<unsigned int> keys_tmp(n);
+	vector<int> values_tmp(n);
+	vector<int> offsets(n_blocks * n_buckets);
+
+	for (int shift = 0; shift < 30; shift += bits_per_pass) {
+		fill(offsets.begin(), offsets.end(), 0);
+
+#pragma omp parallel for
+		for (int blk = 0; blk < n_blocks; blk++) {
+			int* hist = &offsets[blk * n_buckets];
+			for (int i = blk * block_size; i < MIN(n, (blk + 1) * block_size); i++)
+				hist[(keys[i] >> shift) & (n_buckets - 1)]++;
+		}
+
+		//exclusive prefix sum, bucket major: block b writes its share of each bucket after blocks 0..b-1
+		int sum = 0;
+		for (int bucket = 0; bucket < n_buckets; bucket++)
+			for (int blk = 0; blk < n_blocks; blk++) {
+				int count = offsets[blk * n_buckets + bucket];
+				offsets[blk * n_buckets + bucket] = sum;
+				sum += count;
+			}
+
+#pragma omp parallel for
+		for (int blk = 0; blk < n_blocks; blk++) {
+			int* offset = &offsets[blk * n_buckets];
+			for (int i = blk * block_size; i < MIN(n, (blk + 1) * block_size); i++) {
+				int dst = offset[(keys[i] >> shift) & (n_buckets - 1)]++;
+				keys_tmp[dst] = keys[i];
+				values_tmp[dst] = values[i];
+			}
+		}
+
+		keys.swap(keys_tmp);
+		values.swap(values_tmp);
+	}
+}
+
+BVH::BuildNode* BVH::build_lbvh() {
+	int n_objs = prims.size();
+	if (n_objs == 0) {
+		BuildNode* leaf = new BuildNode();
+		leaf->bbox = AABB(Vector(0.0f, 0.0f, 0.0f), Vector(0.0f, 0.0f, 0.0f));
+		return leaf;
+	}
+
+	AABB centroid_bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	for (const BVHPrim& prim : prims)
+		centroid_bbox.extend(prim.centroid);
+
+	Vector extent = centroid_bbox.max - centroid_bbox.min;
+	Vector scale = Vector(extent.x > 0.0f ? 1.0f / extent.x : 0.0f,
+		extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+		extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+
+	vector<unsigned int> codes(n_objs);
+	vector<int> order(n_objs);
+#pragma omp parallel for
+	for (int i = 0; i < n_objs; i++) {
+		Vector c = prims[i].centroid - centroid_bbox.min;
+		codes[i] = morton_code(c.x * scale.x, c.y * scale.y, c.z * scale.z);
+		order[i] = i;
+	}
+
+	radix_sort(codes, order);
+
+	vector<BVHPrim> sorted_prims(n_objs);
+#pragma omp parallel for
+	for (int i = 0; i < n_objs; i++)
+		sorted_prims[i] = prims[order[i]];
+	prims.swap(sorted_prims);
+
+	// treelets: runs of objects whose codes share the highest TreeletBits bits
+	int treelet_shift = 30 - TreeletBits;
+	vector<int> treelet_start;
+	for (int i = 0; i < n_objs; i++)
+		if (i == 0 || (codes[i] >> treelet_shift) != (codes[i - 1] >> treelet_shift))
+			treelet_start.push_back(i);
+	treelet_start.push_back(n_objs);
+
+	int n_treelets = treelet_start.size() - 1;
+	vector<BuildNode*> treelets(n_treelets);
+#pragma omp parallel for schedule(dynamic)
+	for (int t = 0; t < n_treelets; t++)
+		treelets[t] = emit_lbvh(treelet_start[t], treelet_start[t + 1], treelet_shift - 1, codes);
+
+	return build_upper_sah(treelets, 0, n_treelets);
+}
+
+// Builds the subtree of the sorted objects in [left_index, right_index), whose codes are all equal
+// above bit_index, by splitting the range where that bit goes from 0 to 1
+BVH::BuildNode* BVH::emit_lbvh(int left_index, int right_index, int bit_index, const vector<unsigned int>& codes) {
+	BuildNode* node = new BuildNode();
+	int n_objs = right_index - left_index;
+
+	//skip the bits where all the codes of the range agree: they don't split anything
+	while (bit_index >= 0 && ((codes[left_index] ^ codes[right_index - 1]) & (1u << bit_index)) == 0)
+		bit_index--;
+
+	if (n_objs <= LBVHLeafSize) {
+		node->index = left_index;
+		node->n_objs = n_objs;
+		node->bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+		for (int i = left_index; i < right_index; i++)
+			node->bbox.extend(prims[i].bbox);
+		return node;
+	}
+
+	int split_index;
+	if (bit_index < 0)
+		split_index = left_index + n_objs / 2;   //too many objects with the same code: split them in half
+	else {
+		node->axis = 2 - bit_index % 3;   //Morton bits are interleaved as ...xyzxyz
+		//first object of the range with the bit set
+		unsigned int mask = 1u << bit_index;
+		split_index = partition_point(codes.begin() + left_index, codes.begin() + right_index,
+			[mask](unsigned int code) { return (code & mask) == 0; }) - codes.begin();
+	}
+
+	node->children[0] = emit_lbvh(left_index, split_index, bit_index - 1, codes);
+	node->children[1] = emit_lbvh(split_index, right_index, bit_index - 1, codes);
+	node->bbox = node->children[0]->bbox;
+	node->bbox.extend(node->children[1]->bbox);
+	return node;
+}
+
+// Joins the treelets in [start, end) with a binned SAH over their bounding boxes
+BVH::BuildNode* BVH::build_upper_sah(vector<BuildNode*>& treelets, int start, int end) {
+	if (end - start == 1)
+		return treelets[start];
+
+	BuildNode* node = new BuildNode();
+	node->bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	AABB centroid_bbox = node->bbox;
+	for (int i = start; i < end; i++) {
+		node->bbox.extend(treelets[i]->bbox);
+		centroid_bbox.extend(treelets[i]->bbox.centroid());
+	}
+
+	int axis = 0;
+	Vector extent = centroid_bbox.max - centroid_bbox.min;
+	if (extent.y > extent.x) axis = 1;
+	if (extent.z > extent.getAxisValue(axis)) axis = 2;
+
+	float cmin = centroid_bbox.min.getAxisValue(axis);
+	float k = extent.getAxisValue(axis) > 0.0f ? NumBins / extent.getAxisValue(axis) : 0.0f;
+	auto bin_of = [&](BuildNode* treelet) {
+		return MIN(NumBins - 1, (int)(k * (treelet->bbox.centroid().getAxisValue(axis) - cmin)));
+	};
+
+	AABB bin_bbox[NumBins];
+	int bin_count[NumBins] = { 0 };
+	for (int b = 0; b < NumBins; b++)
+		bin_bbox[b] = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	for (int i = start; i < end; i++) {
+		int b = bin_of(treelets[i]);
+		bin_bbox[b].extend(treelets[i]->bbox);
+		bin_count[b]++;
+	}
+
+	//the cost of a treelet is approximated by its area, as for a single object in the SAH
+	float best_cost = FLT_MAX;
+	int best_split = -1;
+	for (int split = 0; split < NumBins - 1; split++) {
+		AABB left = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+		AABB right = left;
+		int n_left = 0, n_right = 0;
+		for (int b = 0; b <= split; b++) { left.extend(bin_bbox[b]); n_left += bin_count[b]; }
+		for (int b = split + 1; b < NumBins; b++) { right.extend(bin_bbox[b]); n_right += bin_count[b]; }
+		if (n_left == 0 || n_right == 0) continue;
+
+		float cost = n_left * left.area() + n_right * right.area();
+		if (cost < best_cost) {
+			best_cost = cost;
+			best_split = split;
+		}
+	}
+
+	int mid;
+	if (best_split == -1)
+		mid = (start + end) / 2;   //all treelet centroids fall in the same bin
+	else
+		mid = partition(treelets.begin() + start, treelets.begin() + end,
+			[&](BuildNode* treelet) { return bin_of(treelet) <= best_split; }) - treelets.begin();
+
+	node->axis = axis;
+	node->children[0] = build_upper_sah(treelets, start, mid);
+	node->children[1] = build_upper_sah(treelets, mid, end);
+	return node;
+}
@@ -30,6 +30,7 @@ bool P3F_scene = true; //choose between P3F scene or the built-in Peter Shirley
 bool Progressive_flg = false;
 
 #define MAX_DEPTH 4  //number of bounces
+#define PACKET_TILE 4  //with a BVH, Whitted ray tracing traces the primary rays of PACKET_TILE x PACKET_TILE pixels as one packet
 
 #define CAPTION "Accel Distribution RT"
 #define VERTEX_COORD_ATTRIB 0
@@ -78,6 +79,10 @@ Scene* scene = NULL;
 Grid* grid_ptr = NULL;
 BVH* bvh_ptr = NULL;
 
+//No acceleration: the spheres are tested a SIMD block at a time, then the other objects one by one
+SphereBlocks sphere_blocks;
+vector<PrimId> sphere_ids, other_ids;
+
 int RES_X, RES_Y;
 
 
@@ -282,36 +287,56 @@ void timer(int value)
 
 ///////////////////////////////////////////////////YOUR CODE HERE////////////////////////////////////////////////////////////////////////
 
+Color shadeHit(Ray& ray, const Object* hitObj, HitRecord& closestHit, int depth, float ior_1, Vector lightSample);
+
+// Is any object between the origin of the shadow ray and the light? The ray's tmax is the light's distance
+bool inShadow(Ray& ray)
+{
+	if (Accel_Struct == GRID_ACC)
+		return grid_ptr->Traverse(ray);
+	else if (Accel_Struct == BVH_ACC)
+		return bvh_ptr->Traverse(ray);
+
+	if (!sphere_ids.empty() && sphere_blocks.Occludes(0, sphere_ids.size(), ray))
+		return true;
+	const Primitives* primitives = scene->GetPrimitives();
+	for (PrimId id : other_ids)
+		if (primitives->Occludes(id, ray))
+			return true;
+	return false;
+}
+
 Color rayTracing(Ray ray, int depth, float ior_1, Vector lightSample)  //index of refraction of medium 1 where the ray is travelling
 {
 	Color color_Acc; //Class constructor init the color with zero
 
 	const Object* hitObj = NULL; //nearest object
 	HitRecord closestHit;  //isHit=false and t=FLT_MAX
-	Vector hitPoint; //closest hit point
-	Vector N;
-	HitRecord auxRec;
 	bool skybox_flg;
-	int num_lights = scene->getNumLights();
 	skybox_flg = scene->GetSkyBoxFlg();
 	Accel_Struct = scene->GetAccelStruct();   //Type of acceleration data structure
 
-int num_objects = scene->getNumObjects();
-
-
 	if (Accel_Struct == NONE) {  //no acceleration
 		/* Get the closest intersection*/
-		for (int i = 0; i < num_objects; i++)
+		const Primitives* primitives = scene->GetPrimitives();
+		if (!sphere_ids.empty()) {
+			int j = sphere_blocks.Hit(0, sphere_ids.size(), ray, closestHit);
+			if (j >= 0) {
+				hitObj = primitives->Get(sphere_ids[j]);
+				ray.tmax = closestHit.t;
+			}
+		}
+		for (PrimId id : other_ids)
 		{
-			const auto& obj = *scene->getObject(i);
-			auto hit = obj.hit(ray);
+			auto hit = primitives->Hit(id, ray);
 			if (!hit.isHit) {
 				continue;
 			}
 
 			if (!closestHit.isHit || hit.t < closestHit.t) {
 				closestHit = hit;
-				hitObj = &obj;
+				hitObj = primitives->Get(id);
+				ray.tmax = hit.t;   //farther objects are rejected early
 			}
 		}
 
@@ -348,6 +373,18 @@ int num_objects = scene->getNumObjects();
 		}
 	}
 
+	return shadeHit(ray, hitObj, closestHit, depth, ior_1, lightSample);
+}
+
+// Color of the closest hit of the ray: direct lighting plus the reflected and refracted rays
+Color shadeHit(Ray& ray, const Object* hitObj, HitRecord& closestHit, int depth, float ior_1, Vector lightSample)
+{
+	Color color_Acc; //Class constructor init the color with zero
+	Vector hitPoint; //closest hit point
+	Vector N;
+	int num_lights = scene->getNumLights();
+
+	hitObj->computeSurface(ray, closestHit);   //the hit only carries t until now
 	hitPoint = ray.origin + ray.direction * closestHit.t;
 	N = closestHit.normal;
 	hitPoint += N * EPSILON;
@@ -357,23 +394,15 @@ int num_objects = scene->getNumObjects();
 	for (int i = 0; i < num_lights; i++) {
 		const auto& light = *scene->getLight(i);
 
-		auto l = (light.position - hitPoint).normalize();
+		Vector to_light = light.position - hitPoint;
+		float light_distance = to_light.length();
+		auto l = to_light / light_distance;
 		if (l * N <= 0) {
 			continue;
 		}
 
-		auto light_ray = Ray(hitPoint, (light.position - hitPoint).normalize());
-		bool wasHit = false;
-		for (int i = 0; i < num_objects; i++)
-		{
-			const auto& obj = *scene->getObject(i);
-			auto hit = obj.hit(light_ray);
-			if (hit.isHit) {
-				wasHit = true;
-				break;
-			}
-		}
-		if (wasHit) {
+		auto light_ray = Ray(hitPoint, l, 0.0f, light_distance);
+		if (inShadow(light_ray)) {
 			continue;
 		}
 
@@ -412,10 +441,68 @@ int num_objects = scene->getNumObjects();
 }
 
 
+// Stores the final color of pixel (x, y) of ZONE B: in the arrays drawn by OpenGL or in the image to save.
+// Indexed by the pixel, as the pixels are rendered in parallel and in any order
+void storePixel(int x, int y, const Color& color)
+{
+	if (drawModeEnabled) {
+		int index_pos = 2 * (x + RES_X * y);
+		vertices[index_pos] = (float)x;
+		vertices[index_pos + 1] = (float)y;
+
+		int index_col = 3 * (x + RES_X * y);
+		colors[index_col] = (float)color.r();
+		colors[index_col + 1] = (float)color.g();
+		colors[index_col + 2] = (float)color.b();
+	}
+	else {
+		int index_img = 3 * (x + RES_X * y);
+		img_Data[index_img] = u8fromfloat((float)color.r());
+		img_Data[index_img + 1] = u8fromfloat((float)color.g());
+		img_Data[index_img + 2] = u8fromfloat((float)color.b());
+	}
+}
+
+// ZONE B.3: the primary rays of each tile of pixels are traced together through the BVH. Only the first
+// hits come from the packet: shading, shadow rays and the secondary rays are traced one at a time
+void renderPacketTiles()
+{
+	static_assert(PACKET_TILE * PACKET_TILE <= BVH::MaxPacketSize, "a tile must fit in one packet");
+
+#pragma omp parallel for collapse(2) schedule(dynamic)
+	for (int ty = 0; ty < RES_Y; ty += PACKET_TILE) {
+		for (int tx = 0; tx < RES_X; tx += PACKET_TILE) {
+			Ray rays[BVH::MaxPacketSize];
+			const Object* hitObjs[BVH::MaxPacketSize];
+			HitRecord hits[BVH::MaxPacketSize];  //isHit=false and t=FLT_MAX
+			int x_end = MIN(tx + PACKET_TILE, RES_X), y_end = MIN(ty + PACKET_TILE, RES_Y);
+			int n_rays = 0;
+
+			for (int y = ty; y < y_end; y++)
+				for (int x = tx; x < x_end; x++)
+					rays[n_rays++] = scene->GetCamera()->PrimaryRay(Vector(x + 0.5f, y + 0.5f, 0.0f));
+
+			int hit_mask = bvh_ptr->TraversePacket(rays, n_rays, hitObjs, hits);
+
+			int r = 0;
+			for (int y = ty; y < y_end; y++) {
+				for (int x = tx; x < x_end; x++, r++) {
+					Color color;
+					if (hit_mask & (1 << r))
+						color = shadeHit(rays[r], hitObjs[r], hits[r], 1, 1.0, Vector(0.0f, 0.0f, 0.0f));
+					else
+						color = scene->GetBackgroundColor().clamp();
+
+					storePixel(x, y, color);
+				}
+			}
+		}
+	}
+}
+
 // Render function by primary ray casting from the eye towards the scene's objects
 void renderScene()
 {
-	unsigned int counter = 0;
 	set_rand_seed(time(NULL) * time(NULL)); // Use current time as seed for random generator
 
 	if (drawModeEnabled) {
@@ -486,61 +573,49 @@ void renderScene()
 
 	//////////////ZONE B - NOT Progressive RayTracer////////////////////////////////////
 	else {
+		if (!AA && scene->GetAccelStruct() == BVH_ACC)
+			renderPacketTiles();
+		else {
 #pragma omp parallel for collapse(2)
-		for (int y = 0; y < RES_Y; y++) {
-			for (int x = 0; x < RES_X; x++) {
-				Color color;
-				int index_pos = 0;
-				int index_col = 0;
-				Ray ray;
-				Vector pixel_sample;  //viewport coordinates
-				Vector light_sample = Vector(0.0f, 0.0f, 0.0f); // sample in Light coordinates
-
-				////// ZONE B.1  -  Distribution Ray Tracer: pixel, area light and lens supersampling with jittering (or stratified)
-				if(AA) {
-					#pragma omp parallel for
-					for (int p = 0; p < spp; p++) {
-						if(!DOF) ray = scene->GetCamera()->PrimaryRay(pixel_sample);
-						else {        // sample_unit_disk() returns [-1 1] and aperture is the diameter of the lens
-
-							Vector lens_sample = rnd_unit_disk() * scene->GetCamera()->GetAperture() / 2.0f;  // lens sample in Camera coordinates
+			for (int y = 0; y < RES_Y; y++) {
+				for (int x = 0; x < RES_X; x++) {
+					Color color;
+					Ray ray;
+					Vector pixel_sample;  //viewport coordinates
+					Vector light_sample = Vector(0.0f, 0.0f, 0.0f); // sample in Light coordinates
+
+					////// ZONE B.1  -  Distribution Ray Tracer: pixel, area light and lens supersampling with jittering (or stratified)
+					if(AA) {
+						#pragma omp parallel for
+						for (int p = 0; p < spp; p++) {
+							if(!DOF) ray = scene->GetCamera()->PrimaryRay(pixel_sample);
+							else {        // sample_unit_disk() returns [-1 1] and aperture is the diameter of the lens
+
+								Vector lens_sample = rnd_unit_disk() * scene->GetCamera()->GetAperture() / 2.0f;  // lens sample in Camera coordinates
+
+								/////////PROGRAM THE FOLLOWING FUNCTION//////////////////////
+								ray = scene->GetCamera()->PrimaryRay(lens_sample, pixel_sample);
+							}
 
 							/////////PROGRAM THE FOLLOWING FUNCTION//////////////////////
-							ray = scene->GetCamera()->PrimaryRay(lens_sample, pixel_sample);
+							color += rayTracing(ray, 1, 1.0, light_sample);
 						}
-
-						/////////PROGRAM THE FOLLOWING FUNCTION//////////////////////
-						color += rayTracing(ray, 1, 1.0, light_sample);
+						color *= 1.0/((float)spp);
 					}
-					color *= 1.0/((float)spp);
-				}
 
-				//ZONE B.2  - Whitted ray tracer  (without antialiasing)
-				else {
-
-					pixel_sample.x = x + 0.5f;
-					pixel_sample.y = y + 0.5f;
+					//ZONE B.2  - Whitted ray tracer  (without antialiasing)
+					else {
 
-					/////////PROGRAM THE FOLLOWING FUNCTION//////////////////////
-					Ray ray1 = scene->GetCamera()->PrimaryRay(pixel_sample);
-					/////////PROGRAM THE FOLLOWING FUNCTION//////////////////////
-					color = rayTracing(ray1, 1, 1.0, light_sample);  //light_sample is a dummy variable in this case,
-				}
+						pixel_sample.x = x + 0.5f;
+						pixel_sample.y = y + 0.5f;
 
-				if (drawModeEnabled) {
-					index_pos = 2 * (x + RES_X * y);
-					vertices[index_pos] = (float)x;
-					vertices[index_pos + 1] = (float)y;
+						/////////PROGRAM THE FOLLOWING FUNCTION//////////////////////
+						Ray ray1 = scene->GetCamera()->PrimaryRay(pixel_sample);
+						/////////PROGRAM THE FOLLOWING FUNCTION//////////////////////
+						color = rayTracing(ray1, 1, 1.0, light_sample);  //light_sample is a dummy variable in this case,
+					}
 
-					index_col = 3 * (x + RES_X * y);
-					colors[index_col] = (float)color.r();
-					colors[index_col+1] = (float)color.g();
-					colors[index_col+2] = (float)color.b();
-				}
-				else {
-					img_Data[counter++] = u8fromfloat((float)color.r());
-					img_Data[counter++] = u8fromfloat((float)color.g());
-					img_Data[counter++] = u8fromfloat((float)color.b());
+					storePixel(x, y, color);
 				}
 			}
 		}
@@ -846,28 +921,57 @@ void init_scene(void)
 
 	if (Accel_Struct == GRID_ACC) {
 		grid_ptr = new Grid();
-		vector<Object*> objs;
+		grid_ptr->setPrimitives(scene->GetPrimitives());
+		grid_ptr->setTwoLevel(scene->GetGridTwoLevel());
+		vector<PrimId> objs;
 		int num_objects = scene->getNumObjects();
 
 		for (int o = 0; o < num_objects; o++) {
-			objs.push_back(scene->getObject(o));
+			objs.push_back(scene->getObjectId(o));
 		}
 		grid_ptr->Build(objs);
 		printf("Grid built.\n\n");
 	}
 	else if (Accel_Struct == BVH_ACC) {
-		vector<Object*> objs;
+		vector<PrimId> objs;
 		int num_objects = scene->getNumObjects();
 		bvh_ptr = new BVH();
+		bvh_ptr->setBuilder(scene->GetBVHBuilder());
+		bvh_ptr->setQuantized(scene->GetBVHQuantized());
+		bvh_ptr->setPrimitives(scene->GetPrimitives());
 
 		for (int o = 0; o < num_objects; o++) {
-			objs.push_back(scene->getObject(o));
+			objs.push_back(scene->getObjectId(o));
+		}
+
+		//P3F scenes keep their BVH in a cache file next to them, rebuilt when it doesn't match the scene
+		char cache_name[80];
+		snprintf(cache_name, sizeof(cache_name), "%s.bvh", scene_name);
+		if (P3F_scene && bvh_ptr->Load(cache_name, objs))
+			printf("BVH loaded.\n\n");
+		else {
+			bvh_ptr->Build(objs);
+			if (P3F_scene) bvh_ptr->Save(cache_name, objs);
+			printf("BVH built.\n\n");
 		}
-		bvh_ptr->Build(objs);
-		printf("BVH built.\n\n");
 	}
-	else
+	else {
+		const Primitives* primitives = scene->GetPrimitives();
+		int num_objects = scene->getNumObjects();
+		Vector center;
+		float radius;
+
+		sphere_ids.clear();
+		other_ids.clear();
+		for (int o = 0; o < num_objects; o++) {
+			PrimId id = scene->getObjectId(o);
+			if (primitives->Get(id)->GetSphere(center, radius)) sphere_ids.push_back(id);
+			else other_ids.push_back(id);
+		}
+		sphere_blocks.Clear();
+		sphere_blocks.Add(*primitives, sphere_ids.data(), sphere_ids.size());
 		printf("No acceleration data structure.\n\n");
+	}
 
 	unsigned int spp = scene->GetSamplesPerPixel();
 	if (spp == 0)
@@ -1,6 +1,7 @@
 #ifndef RAY_H
 #define RAY_H
 
+#include <cfloat>
 #include "vector.h"
 
 class Ray
@@ -8,8 +9,10 @@ class Ray
 public:
 	Ray() {};
 	Ray(const Vector& o, const Vector& dir ) : origin(o), direction(dir) {};
+	Ray(const Vector& o, const Vector& dir, float t_min, float t_max) : origin(o), direction(dir), tmin(t_min), tmax(t_max) {};
 
 	Vector origin;
 	Vector direction;
+	float tmin = 0.0f, tmax = FLT_MAX;   //only hits with tmin <= t <= tmax count; closest hit searches lower tmax to each hit found
 };
-#endif
\ No newline at end of file
+#endif
@@ -1,94 +1,342 @@
 #ifndef ACCELERATOR_H
 #define ACCELERATOR_H
 
-#include <stack>
 #include <queue>
 #include <cmath>
 #include <algorithm>
+#include <emmintrin.h>
 #include "scene.h"
 
 using namespace std;
 
+bool HasAVX2(void);   //checked once at start up: the SIMD blocks below have 8 lanes with AVX2, else 4 with SSE
+
+//Triangles of the leaves of an accelerator (BVH leaves, grid cells) packed in SoA blocks, so one ray is tested
+//against a whole block at once. The width of the blocks is picked at run time: 8 lanes when the CPU has AVX2,
+//else 4 with SSE. A leaf gets blocks only when all its objects are triangles; unused lanes never hit
+class TriangleBlocks
+{
+public:
+	void Clear(void);
+	int Add(const Primitives& primitives, const PrimId* objs, int n_objs);   //packs a leaf, returning its first block, or -1 if not all are triangles
+	//nearest hit within the ray's interval among the n_objs triangles starting at block: index of the triangle in the leaf, or -1.
+	//With lanes, only the triangles whose bit is set in the byte of their block (bit j % Width() of byte j / Width()) are hit
+	int Hit(int block, int n_objs, const Ray& ray, HitRecord& rec, const unsigned char* lanes = NULL) const;
+	bool Occludes(int block, int n_objs, const Ray& ray, const unsigned char* lanes = NULL) const;   //any hit within the ray's interval
+	static int Width(void);
+
+private:
+	vector<float> data;   //per block: first vertex, edge1 and edge2, each as Width() x's, then y's, then z's
+};
+
+//Spheres packed the same way, for the leaves of sphere scenes and for the scenes traced without an accelerator
+class SphereBlocks
+{
+public:
+	void Clear(void);
+	int Add(const Primitives& primitives, const PrimId* objs, int n_objs);   //packs a leaf, returning its first block, or -1 if not all are spheres
+	int Hit(int block, int n_objs, const Ray& ray, HitRecord& rec, const unsigned char* lanes = NULL) const;   //as in TriangleBlocks
+	bool Occludes(int block, int n_objs, const Ray& ray, const unsigned char* lanes = NULL) const;
+	static int Width(void);
+
+private:
+	vector<float> data;   //per block: center x's, y's and z's, radii and squared radii, Width() of each
+};
+
+//The SIMD blocks of the leaves of an accelerator. A leaf of triangles or of spheres is packed in the blocks of
+//its type; its handle tells which: triangle blocks count up from 0, sphere blocks down from -2
+class LeafBlocks
+{
+public:
+	void Clear(void) { triangles.Clear(); spheres.Clear(); }
+	int Add(const Primitives& primitives, const PrimId* objs, int n_objs) {   //handle of the leaf, -1 if it can't be packed
+		int block = triangles.Add(primitives, objs, n_objs);
+		if (block >= 0) return block;
+		block = spheres.Add(primitives, objs, n_objs);
+		return block >= 0 ? -2 - block : -1;
+	}
+	int Hit(int handle, int n_objs, const Ray& ray, HitRecord& rec, const unsigned char* lanes = NULL) const {
+		return handle >= 0 ? triangles.Hit(handle, n_objs, ray, rec, lanes) : spheres.Hit(-2 - handle, n_objs, ray, rec, lanes);
+	}
+	bool Occludes(int handle, int n_objs, const Ray& ray, const unsigned char* lanes = NULL) const {
+		return handle >= 0 ? triangles.Occludes(handle, n_objs, ray, lanes) : spheres.Occludes(-2 - handle, n_objs, ray, lanes);
+	}
+	static int Width(void) { return TriangleBlocks::Width(); }   //the same for the spheres
+
+private:
+	TriangleBlocks triangles;
+	SphereBlocks spheres;
+};
+
 class Grid
 {
 public:
 	Grid(void);
 	//~Grid(void);
 	int getNumObjects() const;
-	void addObject(Object* o);
+	void addObject(PrimId o);
 	void setAABB(AABB& bbox_);
+	void setPrimitives(Primitives* primitives_) { primitives = primitives_; }   //where the objects given to Build live
+	void setTwoLevel(bool two_level_) { two_level = two_level_; }   //accel grid2: overfull cells get a grid of their own
 	Object* getObject(unsigned int index) const;
-	void Build(vector<Object*>& objs);   // set up grid cells
+	void Build(vector<PrimId>& objs);   // set up grid cells
 	bool Traverse(Ray& ray, const Object **hitobject, HitRecord& hitRec) const;
-	bool Traverse(Ray& ray) const;  //Traverse for shadow ray
+	bool Traverse(Ray& ray) const;  //Traverse for shadow ray: is there any hit within the ray's interval?
 
 private:
-	vector<Object *> objects;
-	vector<vector<Object*> > cells;
+	//a uniform grid of cells: the grid itself or, in a two-level grid, the sub-grid of an overfull cell
+	struct Level {
+		AABB bbox;
+		int nx, ny, nz;   // number of cells in the x, y, and z directions
+		int first_cell;   // index of its cell (0, 0, 0) in cell_offsets and cell_blocks
+	};
+
+	Primitives* primitives = NULL;
+	vector<PrimId> objects;
+	vector<PrimId> unbounded;   //planes: outside the cells, so the grid's box stays tight around the other objects
+	//the objects of cell i are cell_objects[cell_offsets[i]] up to cell_objects[cell_offsets[i + 1]] (excluded), so
+	//all the cells share one array and a ray steps from cell to cell without chasing a pointer per cell
+	vector<unsigned int> cell_offsets;
+	vector<PrimId> cell_objects;
+	//each cell holds first the objects found in no other cell, then, from cell_shared[i] on, the ones in several
+	//cells, which go through the ray's Mailbox so they are only tested in the first of them
+	vector<unsigned int> cell_shared;
+	vector<unsigned int> cell_indices;   //of each entry of cell_objects: the object's index among the grid's, for the Mailbox
+	unsigned int n_indices = 0;
+	LeafBlocks cell_packs;
+	vector<int> cell_blocks;   //handle of the blocks of each cell, -1 for cells that aren't packed
+	//Chebyshev distance, in cells of its level, from each cell to the nearest one with objects (0 for those,
+	//at most 255): a ray in a cell at distance d can jump over the cells within d - 1 of it
+	vector<unsigned char> cell_empty;
+
+	//the objects in several cells a ray has been tested against, so each is intersected once per ray: a stamp
+	//of the ray is written at the index of each. The stamps are an array per thread, so the threads never share
+	//them, and a thread runs one grid traversal at a time: the instances traced within one use BVHs
+	class Mailbox {
+	public:
+		Mailbox(unsigned int n_indices);
+		Mailbox(const Mailbox&) = delete;
+		Mailbox& operator=(const Mailbox&) = delete;
+		bool tested(unsigned int index) {   //stamps the object, returning whether it already was
+			if (stamps[index] == ray) return true;
+			stamps[index] = ray;
+			return false;
+		}
+		//for the blocks of a packed cell: the lanes of its objects in no other cell and of the untested others
+		const unsigned char* untested_lanes(const unsigned int* indices, int n_local, int n_objs);
+
+	private:
+		unsigned int* stamps;
+		unsigned int ray;
+		static const int FixedLanes = 64;   //a byte per block; the heap for the cells with more blocks
+		unsigned char fixed_lanes[FixedLanes];
+		vector<unsigned char> heap_lanes;
+	};
 
-	int nx, ny, nz; // number of cells in the x, y, and z directions
+	Level top;
+	vector<Level> sub_grids;
+	vector<int> cell_sub_grid;   //sub-grid of each cell of the top level, -1 for cells without one
+	bool two_level = false;
+	int SubGridObjects = 16;   //cells with more objects are split in a sub-grid
 	float m = 2.0f; // factor that allows to vary the number of cells
+	float sub_m = 1.0f;   //same for the sub-grids; denser ones multiply the references for little gain
+	int ParallelFillSize = 4096;   //levels with more objects are filled in parallel
+
+	void fill_cells(Level& level, const vector<PrimId>& objs, const vector<unsigned int>& indices, vector<unsigned char>& shared);
+	void empty_distances(const Level& level);
 
 	//Setup function for Grid traversal
-	bool Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, double& dty, double& dtz, double& tx_next, double& ty_next, double& tz_next,
+	bool Init_Traverse(const Level& level, Ray& ray, int& ix, int& iy, int& iz, double& dtx, double& dty, double& dtz, double& tx_next, double& ty_next, double& tz_next,
 		int& ix_step, int& iy_step, int& iz_step, int& ix_stop, int& iy_stop, int& iz_stop) const;
-
-	AABB bbox;
+	template <class Visit> bool walk(const Level& level, Ray& ray, Visit& visit) const;
 };
 
 /*********************************BVH*****************************************************************/
 class BVH
 {
+	struct BVHPrim {   //build-time copy of an object's bounds, so GetBoundingBox() is only called once per object
+		AABB bbox;
+		Vector centroid;
+		PrimId obj;
+	};
+
 	class Comparator {
 	public:
 		int dimension;
 
-		bool operator() (Object* a, Object* b) {
-			float ca = a->getCentroid().getAxisValue(dimension);
-			float cb = b->getCentroid().getAxisValue(dimension);
-			return ca < cb;
+		bool operator() (const BVHPrim& a, const BVHPrim& b) {
+			return a.centroid.getAxisValue(dimension) < b.centroid.getAxisValue(dimension);
 		}
 	};
 
-	class BVHNode {
-	private:
+	struct BuildNode {   //temporary tree made by the builder, flattened into the nodes vector at the end of Build
 		AABB bbox;
+		BuildNode* children[2] = { NULL, NULL };
+		unsigned int index = 0, n_objs = 0;   // range of objects, only for leaves
+		int axis = 0;                         // split axis, only for interior nodes
+	};
+
+	// 32 bytes, so two nodes fill a cache line. Nodes are stored in depth-first order:
+	// the first child of an interior node is always the node right after it
+	class alignas(32) BVHNode {
+	private:
+		Vector min, max;
+		unsigned int index;	// if leaf == false: index to the second child node,
+							// else if leaf == true: index to first Intersectable (object id) in objects vector
+		unsigned short n_objs;
+		unsigned char axis;	// split axis of interior nodes
 		bool leaf;
-		unsigned int n_objs;
-		unsigned int index;	// if leaf == false: index to left child node,
-							// else if leaf == true: index to first Intersectable (Object *) in objects vector
 
 	public:
 		BVHNode(void);
-		void setAABB(AABB& bbox_);
+		void setAABB(const AABB& bbox_);
 		void makeLeaf(unsigned int index_, unsigned int n_objs_);
-		void makeNode(unsigned int left_index_);
-		bool isLeaf() { return leaf; }
-		unsigned int getIndex() { return index; }
-		unsigned int getNObjs() { return n_objs; }
-		AABB& getAABB() { return bbox; };
+		void makeNode(unsigned int right_index_, int axis_);
+		bool isLeaf() const { return leaf; }
+		unsigned int getIndex() const { return index; }
+		unsigned int getNObjs() const { return n_objs; }
+		int getAxis() const { return axis; }
+		AABB getAABB() const { return AABB(min, max); };
 	};
+	static_assert(sizeof(BVHNode) == 32, "BVH nodes must stay 32 bytes");
+
+	// 4-wide node collapsed from the binary tree, used for traversal. The children's boxes are kept
+	// in SoA layout so one SSE slab test checks all of them; unused slots get an empty box.
+	struct alignas(64) BVH4Node {
+		float min_x[4], min_y[4], min_z[4];
+		float max_x[4], max_y[4], max_z[4];
+		int child[4];              // index of the child node, or of its first object for leaves
+		unsigned char n_objs[4];   // number of objects of a leaf child, 0 for interior children
+
+		void bounds(__m128 b[2][3]) const;   //the 4 child boxes, as min (b[0]) and max (b[1]) per axis
+		int hit(const __m128 origin[3], const __m128 inv_dir[3], const int sign[3], float t_min, float t_max, float t[4]) const;
+	};
+
+	// Quantized 4-wide node, 64 bytes instead of 128: each child box is stored with 8 bits per coordinate,
+	// counted in steps of 2^exponent from the origin of the node's box. Boxes are rounded outwards, so
+	// they always contain the exact ones; unused slots get min > max
+	struct alignas(64) BVH4QNode {
+		float origin[3];
+		signed char exponent[3];
+		unsigned char n_objs[4];
+		unsigned char min_q[3][4], max_q[3][4];
+		int child[4];
+
+		void bounds(__m128 b[2][3]) const;   //the 4 child boxes, as min (b[0]) and max (b[1]) per axis
+		int hit(const __m128 origin[3], const __m128 inv_dir[3], const int sign[3], float t_min, float t_max, float t[4]) const;
+	};
+	static_assert(sizeof(BVH4QNode) == 64, "quantized BVH nodes must stay 64 bytes");
 
 private:
-	int Threshold = 2;
-	vector<Object*> objects;
-	vector<BVH::BVHNode*> nodes;
+	//SAH cost model: a node becomes a leaf when intersecting all its objects is cheaper than splitting it
+	float TraversalCost = 1.0f;    // cost of visiting an interior node (ray-box tests)
+	float IntersectionCost = 1.0f; // cost of one ray-object intersection
+	int MaxLeafSize = 8;           // nodes with more objects are always split
+	static constexpr int NumBins = 16; // number of SAH bins per axis
+
+	struct Bins {   //SAH bins of a range of objects, for the 3 axes
+		AABB bbox[3][NumBins];
+		int count[3][NumBins];
+	};
+
+	//parallel build: subtrees with more objects than these are built in their own OMP task / binned in parallel
+	int ParallelTaskSize = 4096;
+	int ParallelBinSize = 65536;
+
+	//LBVH: objects sharing the TreeletBits highest Morton code bits form a treelet; treelets are joined with the SAH
+	int TreeletBits = 12;
+	int LBVHLeafSize = 2;
+
+	//SBVH: spatial splits are only tried when the children of the best object split overlap by more than
+	//SBVHOverlapThreshold of the root's area, and at most SBVHDuplicationBudget * n_objs references are added
+	float SBVHOverlapThreshold = 1e-5f;
+	float SBVHDuplicationBudget = 0.3f;
+	int sbvh_budget = 0;
+	float sbvh_root_area = 0.0f;
+
+	//refit: the tree is rebuilt when its SAH cost grows past RebuildThreshold times the cost of the last build
+	float RebuildThreshold = 1.5f;
+	float build_sah_cost = 0.0f;
+	vector<PrimId> scene_objects;   //the objects given to Build, for the rebuilds
+
+	bvhBuilder builder = SAH_BUILD;
+
+	Primitives* primitives = NULL;
+	vector<PrimId> objects;
+	vector<PrimId> unbounded;   //planes: outside the tree, tested by every traversal before it
+	vector<BVH::BVHNode> nodes;
+	vector<BVH4Node> wide_nodes;
+	vector<BVH4QNode> quantized_nodes;   //copy of wide_nodes used for traversal when quantized is set
+	bool quantized = false;
+	vector<BVHPrim> prims;   //only used during Build
+	LeafBlocks leaf_packs;
+	vector<int> leaf_blocks;   //indexed by the first object of a leaf: the handle of its blocks, or -1 if it isn't packed
 
 	struct StackItem {
-		BVHNode* ptr;
+		int index;
 		float t;
-		StackItem(BVHNode* _ptr, float _t) : ptr(_ptr), t(_t) { }
+		StackItem() { }
+		StackItem(int _index, float _t) : index(_index), t(_t) { }
 	};
 
-	//stack<StackItem> hit_stack;  just declare it in the traverse procedure in order to be parallelized with OMP
+	struct PacketItem {   //node to visit and the bit mask of the rays of the packet that enter it
+		int index;
+		unsigned int active;
+	};
+
+	//the traversal stack is a fixed array on the stack of the calling thread, so tracing a ray never allocates.
+	//A tree too deep for it gets a stack on the heap for each traversal instead: one per call, not one per
+	//thread, as tracing a ray through an instance runs a traversal of the mesh's BVH inside the scene's
+	static constexpr int TraversalStackSize = 256;
+	int stack_size = 0;   //entries the traversal of this tree may need, set by build_wide_nodes() and Load()
+	int traversal_stack_size(void) const;
+	template <class Item> Item* traversal_stack(Item* fixed_stack, vector<Item>& heap_stack) const {
+		if (stack_size <= TraversalStackSize) return fixed_stack;
+		heap_stack.resize(stack_size);
+		return heap_stack.data();
+	}
 
 public:
 	BVH(void);
 	int getNumObjects();
+	void setBuilder(bvhBuilder builder_) { builder = builder_; }
+	void setQuantized(bool quantized_) { quantized = quantized_; }
+	void setPrimitives(Primitives* primitives_) { primitives = primitives_; }   //where the objects given to Build live
 
-	void Build(vector<Object*>& objects);
-	void build_recursive(int left_index, int right_index, BVHNode* node);
+	void Build(vector<PrimId>& objects);
+	void build_recursive(int left_index, int right_index, BuildNode* node);
+	void bin_objects(const BVHPrim* refs, int n_refs, const AABB& centroid_bbox, Bins& bins) const;
+	float find_object_split(const Bins& bins, const AABB& centroid_bbox, float inv_node_area, int& best_axis, int& best_split) const;
+	int flatten(BuildNode* build_node);
+	void build_wide_nodes();
+	int collapse(int node_index);
+	void quantize();
+	void build_leaf_blocks();
+	bool hit_leaf(int first, int n_objs, Ray& ray, const Object** hit_obj, HitRecord& hitRec) const;
+	bool occludes_leaf(int first, int n_objs, Ray& ray) const;
+	bool hit_unbounded(Ray& ray, const Object** hit_obj, HitRecord& hitRec) const;
+	AABB refit_recursive(int node_index);
+	void Refit();
+	BuildNode* build_lbvh();
+	BuildNode* emit_lbvh(int left_index, int right_index, int bit_index, const vector<unsigned int>& codes);
+	BuildNode* build_upper_sah(vector<BuildNode*>& treelets, int start, int end);
+	BuildNode* build_sbvh(vector<BVHPrim>& refs, const AABB& bbox);
+	float find_spatial_split(const vector<BVHPrim>& refs, const AABB& bbox, float inv_node_area, int& best_axis, float& best_position) const;
+	void split_references(const vector<BVHPrim>& refs, int axis, float position, vector<BVHPrim>& left_refs, vector<BVHPrim>& right_refs,
+		AABB& left_bbox, AABB& right_bbox);
+	float ComputeSAHCost() const;
+	unsigned long long CacheKey(vector<PrimId>& objs) const;
+	bool ValidTree(void) const;
+	bool Load(const char* path, vector<PrimId>& objs);   //BVH cache file, see bvhCache.cpp
+	bool Save(const char* path, vector<PrimId>& objs) const;
 	bool Traverse(Ray& ray, const Object** hit_obj, HitRecord& hitRec) const;
-	bool Traverse(Ray& ray) const;
+	template <class Node> bool traverse_closest(const vector<Node>& tree, Ray& ray, const Object** hit_obj, HitRecord& hitRec) const;
+	bool Traverse(Ray& ray) const;   //shadow ray: is there any hit within the ray's interval?
+	template <class Node> bool traverse_any(const vector<Node>& tree, Ray& ray) const;
+
+	//coherent rays (primary rays of a tile of pixels) traced together; returns the bit mask of the rays that hit
+	static constexpr int MaxPacketSize = 16;
+	int TraversePacket(Ray* rays, int n_rays, const Object** hit_objs, HitRecord* hitRecs) const;
+	template <class Node> int traverse_packet(const vector<Node>& tree, Ray* rays, int n_rays, const Object** hit_objs, HitRecord* hitRecs) const;
 };
 #endif
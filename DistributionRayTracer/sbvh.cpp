@@ -0,0 +1,222 @@
+#include "rayAccelerator.h"
+#include "macros.h"
+
+using namespace std;
+
+/****************************************************************************************************
+SBVH builder (Stich et al. 2009): besides the object splits of the binned SAH, a node may be split by
+a plane that cuts through some of its objects. Those objects are referenced from both children, each
+reference with the bounding box of the part of the object on its side, which removes the overlap
+between the children that large primitives cause. Spatial splits are only tried where the children
+of the best object split overlap, and the number of extra references is capped by sbvh_budget.
+The build is serial: leaves append their references to prims in depth-first order.
+*****************************************************************************************************/
+
+BVH::BuildNode* BVH::build_sbvh(vector<BVHPrim>& refs, const AABB& bbox) {
+	BuildNode* node = new BuildNode();
+	node->bbox = bbox;
+	int n_refs = refs.size();
+
+	AABB centroid_bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	for (const BVHPrim& ref : refs)
+		centroid_bbox.extend(ref.centroid);
+
+	int object_axis = -1, object_split = -1, spatial_axis = -1;
+	float object_cost = FLT_MAX, spatial_cost = FLT_MAX, spatial_position = 0.0f;
+	float inv_node_area = 1.0f / bbox.area();
+	Bins bins;
+
+	if (n_refs > 1) {
+		bin_objects(refs.data(), n_refs, centroid_bbox, bins);
+		object_cost = find_object_split(bins, centroid_bbox, inv_node_area, object_axis, object_split);
+
+		//a spatial split only pays off where the children of the object split overlap
+		if (object_axis != -1 && sbvh_budget > 0) {
+			AABB left = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+			AABB right = left;
+			for (int b = 0; b < NumBins; b++)
+				(b <= object_split ? left : right).extend(bins.bbox[object_axis][b]);
+			left.clip(right);
+			if (left.area() > SBVHOverlapThreshold * sbvh_root_area)
+				spatial_cost = find_spatial_split(refs, bbox, inv_node_area, spatial_axis, spatial_position);
+		}
+	}
+
+	// leaf termination, as in build_recursive
+	float leaf_cost = IntersectionCost * n_refs;
+	if (n_refs <= 1 || (n_refs <= MaxLeafSize && leaf_cost <= MIN(object_cost, spatial_cost))) {
+		node->index = prims.size();
+		node->n_objs = n_refs;
+		prims.insert(prims.end(), refs.begin(), refs.end());
+		return node;
+	}
+
+	vector<BVHPrim> left_refs, right_refs;
+	AABB left_bbox, right_bbox;
+
+	if (spatial_cost < object_cost) {
+		split_references(refs, spatial_axis, spatial_position, left_refs, right_refs, left_bbox, right_bbox);
+		node->axis = spatial_axis;
+	}
+
+	if (left_refs.empty() || right_refs.empty()) {
+		left_refs.clear();
+		right_refs.clear();
+		left_bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+		right_bbox = left_bbox;
+
+		if (object_axis != -1) {
+			float cmin = centroid_bbox.min.getAxisValue(object_axis);
+			float k = NumBins / (centroid_bbox.max.getAxisValue(object_axis) - cmin);
+			for (const BVHPrim& ref : refs) {
+				bool left = MIN(NumBins - 1, (int)(k * (ref.centroid.getAxisValue(object_axis) - cmin))) <= object_split;
+				(left ? left_refs : right_refs).push_back(ref);
+				(left ? left_bbox : right_bbox).extend(ref.bbox);
+			}
+			node->axis = object_axis;
+		}
+		else {
+			// every centroid is the same point but there are too many references for a leaf: split in half
+			for (int i = 0; i < n_refs; i++) {
+				(i < n_refs / 2 ? left_refs : right_refs).push_back(refs[i]);
+				(i < n_refs / 2 ? left_bbox : right_bbox).extend(refs[i].bbox);
+			}
+			node->axis = 0;
+		}
+	}
+
+	//the references of this node are not needed anymore
+	vector<BVHPrim>().swap(refs);
+
+	node->children[0] = build_sbvh(left_refs, left_bbox);
+	node->children[1] = build_sbvh(right_refs, right_bbox);
+	return node;
+}
+
+// Bins the references in NumBins slabs of equal width of the node's box along each axis. A reference
+// counts as entering its first slab and leaving its last one, and each slab gets the bounds of the
+// part of the reference inside it. Returns the cost of the best plane between slabs (FLT_MAX if none)
+float BVH::find_spatial_split(const vector<BVHPrim>& refs, const AABB& bbox, float inv_node_area, int& best_axis, float& best_position) const {
+	AABB bin_bbox[NumBins];
+	int entries[NumBins], exits[NumBins];
+	float right_area[NumBins];
+	int right_count[NumBins];
+
+	float best_cost = FLT_MAX;
+	best_axis = -1;
+
+	for (int axis = 0; axis < 3; axis++) {
+		float origin = bbox.min.getAxisValue(axis);
+		float extent = bbox.max.getAxisValue(axis) - origin;
+		if (extent <= 0.0f) continue;
+		float bin_width = extent / NumBins;
+		float inv_bin_width = NumBins / extent;
+
+		for (int b = 0; b < NumBins; b++) {
+			bin_bbox[b] = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+			entries[b] = exits[b] = 0;
+		}
+
+		for (const BVHPrim& ref : refs) {
+			int first = MIN(NumBins - 1, MAX(0, (int)((ref.bbox.min.getAxisValue(axis) - origin) * inv_bin_width)));
+			int last = MIN(NumBins - 1, MAX(first, (int)((ref.bbox.max.getAxisValue(axis) - origin) * inv_bin_width)));
+
+			//cut the reference at every slab boundary it crosses
+			AABB rest = ref.bbox;
+			for (int b = first; b < last; b++) {
+				AABB left, right;
+				primitives->Get(ref.obj)->SplitBoundingBox(rest, axis, origin + (b + 1) * bin_width, left, right);
+				bin_bbox[b].extend(left);
+				rest = right;
+			}
+			bin_bbox[last].extend(rest);
+			entries[first]++;
+			exits[last]++;
+		}
+
+		AABB acc = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+		int count = 0;
+		for (int b = NumBins - 1; b > 0; b--) {
+			acc.extend(bin_bbox[b]);
+			count += exits[b];
+			right_area[b - 1] = acc.area();
+			right_count[b - 1] = count;
+		}
+
+		acc = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+		count = 0;
+		for (int b = 0; b < NumBins - 1; b++) {
+			acc.extend(bin_bbox[b]);
+			count += entries[b];
+			if (count == 0 || right_count[b] == 0) continue;
+
+			float cost = TraversalCost + IntersectionCost * (acc.area() * count + right_area[b] * right_count[b]) * inv_node_area;
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_position = origin + (b + 1) * bin_width;
+			}
+		}
+	}
+	return best_cost;
+}
+
+// Distributes the references on both sides of the plane. A reference crossing it is split in two, unless
+// moving it whole to one side is cheaper (reference unsplitting) or the duplication budget is used up
+void BVH::split_references(const vector<BVHPrim>& refs, int axis, float position, vector<BVHPrim>& left_refs, vector<BVHPrim>& right_refs,
+	AABB& left_bbox, AABB& right_bbox) {
+	left_bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	right_bbox = left_bbox;
+	vector<const BVHPrim*> crossing;
+
+	for (const BVHPrim& ref : refs) {
+		if (ref.bbox.max.getAxisValue(axis) <= position) {
+			left_refs.push_back(ref);
+			left_bbox.extend(ref.bbox);
+		}
+		else if (ref.bbox.min.getAxisValue(axis) >= position) {
+			right_refs.push_back(ref);
+			right_bbox.extend(ref.bbox);
+		}
+		else
+			crossing.push_back(&ref);
+	}
+
+	//until decided otherwise, every crossing reference counts on both sides
+	int n_left = left_refs.size() + crossing.size();
+	int n_right = right_refs.size() + crossing.size();
+
+	for (const BVHPrim* ref : crossing) {
+		AABB left_part, right_part;
+		primitives->Get(ref->obj)->SplitBoundingBox(ref->bbox, axis, position, left_part, right_part);
+
+		AABB split_left = left_bbox, split_right = right_bbox;
+		split_left.extend(left_part);
+		split_right.extend(right_part);
+		AABB whole_left = left_bbox, whole_right = right_bbox;
+		whole_left.extend(ref->bbox);
+		whole_right.extend(ref->bbox);
+
+		float split_cost = split_left.area() * n_left + split_right.area() * n_right;
+		float left_cost = whole_left.area() * n_left + right_bbox.area() * (n_right - 1);
+		float right_cost = left_bbox.area() * (n_left - 1) + whole_right.area() * n_right;
+
+		if (sbvh_budget > 0 && split_cost < left_cost && split_cost < right_cost) {
+			left_refs.push_back({ left_part, left_part.centroid(), ref->obj });
+			right_refs.push_back({ right_part, right_part.centroid(), ref->obj });
+			left_bbox = split_left;
+			right_bbox = split_right;
+			sbvh_budget--;
+		}
+		else if (left_cost <= right_cost) {
+			left_refs.push_back(*ref);
+			left_bbox = whole_left;
+			n_right--;
+		}
+		else {
+			right_refs.push_back(*ref);
+			right_bbox = whole_right;
+			n_left--;
+		}
+	}
+}
@@ -6,6 +6,7 @@
 
 #include "maths.h"
 #include "scene.h"
+#include "rayAccelerator.h"
 #include "macros.h"
 
 
@@ -40,23 +41,53 @@ AABB Triangle::GetBoundingBox() {
 	return(AABB(Min, Max));
 }
 
+// The part of the triangle on each side of the plane is bounded by the vertices on that side and by
+// the points where the edges cross the plane
+static void split_triangle_bbox(const Vector points[3], const AABB& bbox, int axis, float position, AABB& left, AABB& right) {
+	left = AABB(Vector(+FLT_MAX, +FLT_MAX, +FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	right = left;
+
+	for (int i = 0; i < 3; i++) {
+		const Vector& p0 = points[i];
+		const Vector& p1 = points[(i + 1) % 3];
+		float v0 = p0.getAxisValue(axis), v1 = p1.getAxisValue(axis);
+
+		if (v0 <= position) left.extend(p0);
+		if (v0 >= position) right.extend(p0);
+		if ((v0 < position && position < v1) || (v1 < position && position < v0)) {
+			Vector p = p0 + (p1 - p0) * ((position - v0) / (v1 - v0));
+			p.setAxisValue(axis, position);
+			left.extend(p);
+			right.extend(p);
+		}
+	}
+
+	// same margin as the full bounding box, but never outside the part of the box on each side
+	left.min -= EPSILON; left.max += EPSILON;
+	right.min -= EPSILON; right.max += EPSILON;
+
+	AABB left_bound = bbox, right_bound = bbox;
+	left_bound.max.setAxisValue(axis, position);
+	right_bound.min.setAxisValue(axis, position);
+	left.clip(left_bound);
+	right.clip(right_bound);
+}
+
+void Triangle::SplitBoundingBox(const AABB& bbox, int axis, float position, AABB& left, AABB& right) {
+	split_triangle_bbox(points, bbox, axis, position, left, right);
+}
+
 
 //
 // Ray/Triangle intersection test using Tomas Moller-Ben Trumbore algorithm.
 //
 
-HitRecord Triangle::hit(Ray& r) const {
+static HitRecord hit_triangle(const Vector& p0, const Vector& edge1, const Vector& edge2, Ray& r) {
 
 	HitRecord rec;
 	rec.t = FLT_MAX;  //not necessary
 	rec.isHit = false;  //not necessary
 
-	/* Calculate the normal */
-	Vector normal = (points[1] - points[0]) % (points[2] - points[1]);  //cross product
-	normal.normalize();
-
-	Vector edge1 = points[1] - points[0];
-	Vector edge2 = points[2] - points[0];
 	Vector ray_cross_e2 = r.direction % edge2;
 	float det = edge1 * ray_cross_e2;
 
@@ -64,30 +95,101 @@ HitRecord Triangle::hit(Ray& r) const {
 		return rec;
 
 	float inv_det = 1.0 / det;
-	Vector s = r.origin - points[0];
+	Vector s = r.origin - p0;
 	float u = inv_det * (s * ray_cross_e2);
 
 	if ((u < 0 && abs(u) > EPSILON) || (u > 1 && abs(u-1) > EPSILON))
 		return rec;
 
+	// t is known as soon as s_cross_e1 is, so a hit outside the ray's interval is rejected before the v test
 	Vector s_cross_e1 = s % edge1;
+	float t = inv_det * (edge2 * s_cross_e1);
+	if (t <= EPSILON || t < r.tmin || t > r.tmax)
+		return rec;
+
 	float v = inv_det * r.direction * s_cross_e1;
 
 	if ((v < 0 && abs(v) > EPSILON) || (u + v > 1 && abs(u + v - 1) > EPSILON))
 		return rec;
 
-	// At this stage we can compute t to find out where the intersection point is on the line.
-	rec.t = inv_det * (edge2 * s_cross_e1);
-	rec.isHit = rec.t > EPSILON;
+	rec.t = t;
+	rec.bary = Vector(1.0f - u - v, u, v);
+	rec.isHit = true;
+
+	return (rec);
+}
+
+HitRecord Triangle::hit(Ray& r) const {
+	return hit_triangle(points[0], points[1] - points[0], points[2] - points[0], r);
+}
 
-	rec.normal = normal;
-	if (rec.normal * r.direction > 0) {
-		rec.normal = -rec.normal;
+// The normal, facing the ray, is only computed for the closest hit
+static Vector triangle_normal(const Vector& edge1, const Vector& p1, const Vector& p2, const Ray& r) {
+	Vector normal = edge1 % (p2 - p1);  //cross product
+	normal.normalize();
+	if (normal * r.direction > 0) {
+		normal = -normal;
 	}
+	return normal;
+}
 
-	return (rec);
+bool Triangle::GetTriangle(Vector& p0, Vector& edge1, Vector& edge2) const {
+	p0 = points[0];
+	edge1 = points[1] - points[0];
+	edge2 = points[2] - points[0];
+	return true;
+}
+
+void Triangle::computeSurface(const Ray& r, HitRecord& rec) const {
+	rec.normal = triangle_normal(points[1] - points[0], points[1], points[2], r);
+}
+
+MeshTriangle::MeshTriangle(const TriangleMesh* a_mesh, unsigned i0, unsigned i1, unsigned i2)
+	: mesh(a_mesh)
+{
+	indices[0] = i0; indices[1] = i1; indices[2] = i2;
+	edge1 = mesh->vertices[i1] - mesh->vertices[i0];
+	edge2 = mesh->vertices[i2] - mesh->vertices[i0];
+}
+
+// Same box as a Triangle's, computed when asked instead of stored
+AABB MeshTriangle::GetBoundingBox() {
+	AABB bbox(Vector(+FLT_MAX, +FLT_MAX, +FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	for (unsigned index : indices)
+		bbox.extend(mesh->vertices[index]);
+	bbox.min -= EPSILON;
+	bbox.max += EPSILON;
+	return bbox;
+}
+
+void MeshTriangle::SplitBoundingBox(const AABB& bbox, int axis, float position, AABB& left, AABB& right) {
+	Vector points[3] = { mesh->vertices[indices[0]], mesh->vertices[indices[1]], mesh->vertices[indices[2]] };
+	split_triangle_bbox(points, bbox, axis, position, left, right);
+}
+
+HitRecord MeshTriangle::hit(Ray& r) const {
+	return hit_triangle(mesh->vertices[indices[0]], edge1, edge2, r);
+}
+
+bool MeshTriangle::GetTriangle(Vector& p0, Vector& edge1_, Vector& edge2_) const {
+	p0 = mesh->vertices[indices[0]];
+	edge1_ = edge1;
+	edge2_ = edge2;
+	return true;
 }
 
+void MeshTriangle::computeSurface(const Ray& r, HitRecord& rec) const {
+	rec.normal = triangle_normal(edge1, mesh->vertices[indices[1]], mesh->vertices[indices[2]], r);
+}
+
+
+// Without knowing the shape of the object, each side gets the part of its box on that side
+void Object::SplitBoundingBox(const AABB& bbox, int axis, float position, AABB& left, AABB& right) {
+	left = bbox;
+	right = bbox;
+	left.max.setAxisValue(axis, position);
+	right.min.setAxisValue(axis, position);
+}
 
 Plane::Plane(Vector& a_PN, float a_D)
 	: PN(a_PN), D(a_D)
@@ -128,7 +230,7 @@ HitRecord Plane::hit( Ray& r) const
 		return rec;
 
 	float t = -((PN * r.origin) + D)/PNxRd;
-	if (t > 0) {
+	if (t > 0 && t >= r.tmin && t <= r.tmax) {
 		rec.t = t;
 		rec.normal = PN;
 		rec.isHit = true;
@@ -153,25 +255,42 @@ HitRecord Sphere::hit(Ray& r) const
 		return rec;
 	}
 
+	// the hits are at -ray_center_offset -/+ sqrt(disc), and sqrt(disc) <= radius (unit direction): the
+	// sphere is rejected before the square root when all of it is outside the ray's interval
+	if (-ray_center_offset - this->radius > r.tmax || -ray_center_offset + this->radius < r.tmin) {
+		return rec;
+	}
+
 	auto disc = ray_center_offset*ray_center_offset - distance_from_surface;
 
 	if (disc < 0.0) {
 		return rec;
 	}
 
-	rec.t = -(ray_center_offset + sqrtf(disc));
+	float root = sqrtf(disc);
+	float t = -(ray_center_offset + root);
+	if (t < r.tmin)   // the near hit is behind the interval (e.g. the ray starts inside): try the far one
+		t = root - ray_center_offset;
+	if (t < r.tmin || t > r.tmax) {
+		return rec;
+	}
 
-	auto hit_point = r.origin + r.direction * rec.t;
-	rec.normal = (hit_point - this->center).normalize();
+	rec.t = t;
 	rec.isHit = true;
 
 	return (rec);
 }
 
+void Sphere::computeSurface(const Ray& r, HitRecord& rec) const
+{
+	auto hit_point = r.origin + r.direction * rec.t;
+	rec.normal = (hit_point - this->center).normalize();
+}
+
 
 AABB Sphere::GetBoundingBox() {
 	Vector a_min = this->center - Vector(this->radius, this->radius, this->radius);
-	Vector a_max = this->center - Vector(this->radius, this->radius, this->radius);
+	Vector a_max = this->center + Vector(this->radius, this->radius, this->radius);
 
 	return(AABB(a_min, a_max));
 }
@@ -258,9 +377,8 @@ HitRecord aaBox::hit(Ray& ray) const
 		tL = tz_max;
 		face_out = (c >= 0.0) ? Vector(0, 0, 1) : Vector(0, 0, -1);
 	}
-	if (tE < tL && tL > 0) { // condition for a hit
-		rec.isHit = true;
-		if (tE > 0) {
+	if (tE < tL && tL > 0 && tL >= ray.tmin) { // condition for a hit
+		if (tE > 0 && tE >= ray.tmin) {
 			rec.t = tE; // ray hits outside surface
 			rec.normal = face_in;
 		}
@@ -268,6 +386,7 @@ HitRecord aaBox::hit(Ray& ray) const
 			rec.t = tL;// ray hits inside surface
 			rec.normal = face_out;
 		}
+		rec.isHit = rec.t <= ray.tmax;
 
 		return (rec);
 	}
@@ -275,6 +394,62 @@ HitRecord aaBox::hit(Ray& ray) const
 
 }
 
+Instance::Instance(Mesh* a_mesh, const Vector& a_translation, const Vector& a_rotation, float a_scale)
+	: mesh(a_mesh), translation(a_translation), scale(a_scale)
+{
+	// rotation around x, then y, then z (angles in degrees)
+	float cx = cos(a_rotation.x * PI / 180.0f), sx = sin(a_rotation.x * PI / 180.0f);
+	float cy = cos(a_rotation.y * PI / 180.0f), sy = sin(a_rotation.y * PI / 180.0f);
+	float cz = cos(a_rotation.z * PI / 180.0f), sz = sin(a_rotation.z * PI / 180.0f);
+	rows[0] = Vector(cy * cz, sx * sy * cz - cx * sz, cx * sy * cz + sx * sz);
+	rows[1] = Vector(cy * sz, sx * sy * sz + cx * cz, cx * sy * sz - sx * cz);
+	rows[2] = Vector(-sy, sx * cy, cx * cy);
+
+	// the box of the mesh's corners, once placed
+	bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	for (int i = 0; i < 8; i++) {
+		Vector corner((i & 1) ? mesh->bbox.max.x : mesh->bbox.min.x,
+			(i & 2) ? mesh->bbox.max.y : mesh->bbox.min.y,
+			(i & 4) ? mesh->bbox.max.z : mesh->bbox.min.z);
+		bbox.extend(to_world(corner) + translation);
+	}
+}
+
+Vector Instance::to_world(const Vector& v) const {
+	return Vector(rows[0] * v, rows[1] * v, rows[2] * v) * scale;
+}
+
+Vector Instance::to_local(const Vector& v) const {
+	return (rows[0] * v.x + rows[1] * v.y + rows[2] * v.z) / scale;
+}
+
+// The ray is moved into the mesh's space and traced through the mesh's BVH. Its direction is not
+// normalized there, so t, and the ray's interval, are the same in both spaces
+HitRecord Instance::hit(Ray& r) const
+{
+	HitRecord rec;
+	const Object* triangle = NULL;
+	Ray local_ray(to_local(r.origin - translation), to_local(r.direction), r.tmin, r.tmax);
+
+	if (mesh->bvh->Traverse(local_ray, &triangle, rec))
+		rec.primitive = triangle;
+	return rec;
+}
+
+// The triangle's normal in the mesh's space, rotated back to the world
+void Instance::computeSurface(const Ray& r, HitRecord& rec) const
+{
+	Ray local_ray(to_local(r.origin - translation), to_local(r.direction));
+	rec.primitive->computeSurface(local_ray, rec);
+	rec.normal = Vector(rows[0] * rec.normal, rows[1] * rec.normal, rows[2] * rec.normal);   //rotation keeps it unit length
+}
+
+bool Instance::occludes(Ray& r) const
+{
+	Ray local_ray(to_local(r.origin - translation), to_local(r.direction), r.tmin, r.tmax);
+	return mesh->bvh->Traverse(local_ray);
+}
+
 
 Scene::Scene()
 {}
@@ -282,6 +457,12 @@ Scene::Scene()
 Scene::~Scene()
 {
 	objects.erase(objects.begin()+1, objects.end()-1);
+	for (auto& mesh : meshes) {
+		delete mesh.second->bvh;
+		delete mesh.second;
+	}
+	for (TriangleMesh* triangle_mesh : triangle_meshes)
+		delete triangle_mesh;
 }
 
 int Scene::getNumObjects()
@@ -290,16 +471,16 @@ int Scene::getNumObjects()
 }
 
 
-void Scene::addObject(Object* o)
+void Scene::addObject(PrimId id)
 {
-	objects.push_back(o);
+	objects.push_back(id);
 }
 
 
 Object* Scene::getObject(unsigned int index)
 {
 	if (index >= 0 && index < objects.size())
-		return objects[index];
+		return primitives.Get(objects[index]);
 	return NULL;
 }
 
@@ -490,8 +671,20 @@ bool Scene::load_p3f(const char *name)
 			this->SetAccelStruct(NONE);
 		else if (accel_type == "grid")
 			this->SetAccelStruct(GRID_ACC);
+		else if (accel_type == "grid2") {
+			this->SetAccelStruct(GRID_ACC);
+			this->SetGridTwoLevel(true);
+		}
 		else if (accel_type == "bvh")
 			this->SetAccelStruct(BVH_ACC);
+		else if (accel_type == "lbvh") {
+			this->SetAccelStruct(BVH_ACC);
+			this->SetBVHBuilder(LBVH_BUILD);
+		}
+		else if (accel_type == "sbvh") {
+			this->SetAccelStruct(BVH_ACC);
+			this->SetBVHBuilder(SBVH_BUILD);
+		}
 		else {
 			printf("Unsupported acceleration type\n");
 			break;
@@ -499,6 +692,20 @@ bool Scene::load_p3f(const char *name)
 
 	  }
 
+	  else if (cmd == "bvhnodes")   //BVH node format: full (float boxes) or quantized (8-bit boxes)
+	  {
+		  string node_type;
+		  file >> node_type;
+		  if (node_type == "full")
+			  this->SetBVHQuantized(false);
+		  else if (node_type == "quantized")
+			  this->SetBVHQuantized(true);
+		  else {
+			  printf("Unsupported BVH node format\n");
+			  break;
+		  }
+	  }
+
 	  else if (cmd == "spp")    //samples per pixel
 	  {
 		  unsigned int spp; // number of samples per pixel
@@ -520,37 +727,34 @@ bool Scene::load_p3f(const char *name)
       {
 	     Vector center;
     	 float radius;
-         Sphere* sphere;
 
 	    file >> center >> radius;
-        sphere = new Sphere(center,radius);
-	    if (material) sphere->SetMaterial(material);
-        this->addObject( (Object*) sphere);
+        Sphere sphere(center,radius);
+	    if (material) sphere.SetMaterial(material);
+        this->addObject(primitives.Add(sphere));
       }
 
 	  else if (cmd == "box")    //axis aligned box
 	  {
 		  Vector minpoint, maxpoint;
-		  aaBox	*box;
 
 		  file >> minpoint >> maxpoint;
-		  box = new aaBox(minpoint, maxpoint);
-		  if (material) box->SetMaterial(material);
-		  this->addObject((Object*)box);
+		  aaBox box(minpoint, maxpoint);
+		  if (material) box.SetMaterial(material);
+		  this->addObject(primitives.Add(box));
 	  }
 	  else if (cmd == "p")  // Polygon: just accepts triangles for now
       {
 		  Vector P0, P1, P2;
-		  Triangle* triangle;
 		  unsigned total_vertices;
 
 		  file >> total_vertices;
 		  if (total_vertices == 3)
 		  {
 			  file >> P0 >> P1 >> P2;
-			  triangle = new Triangle(P0, P1, P2);
-			  if (material) triangle->SetMaterial(material);
-			  this->addObject( (Object*) triangle);
+			  Triangle triangle(P0, P1, P2);
+			  if (material) triangle.SetMaterial(material);
+			  this->addObject(primitives.Add(triangle));
 		  }
 		  else
 		  {
@@ -559,18 +763,30 @@ bool Scene::load_p3f(const char *name)
 		  }
       }
 
-	  else if (cmd == "mesh") {
+	  else if (cmd == "mesh") {   //mesh [name] vertices faces: a named mesh is only drawn by its instances
 		  unsigned total_vertices, total_faces;
 		  unsigned P0, P1, P2;
-		  Triangle* triangle;
-		  Vector* verticesArray, vertex;
-
-		  file >> total_vertices >> total_faces;
-		  verticesArray = (Vector*)malloc(total_vertices * sizeof(Vector));
-		  for (int i = 0; i < total_vertices; i++) {
-			  file >> vertex;
-			  verticesArray[i] = vertex;
+		  TriangleMesh* triangle_mesh;
+		  Mesh* mesh = NULL;
+
+		  file >> token;
+		  if (isdigit(token[0]))
+			  total_vertices = atoi(token);
+		  else {
+			  if (meshes.count(token)) {
+				  cerr << "mesh '" << token << "' already defined.\n";
+				  break;
+			  }
+			  mesh = new Mesh();
+			  meshes[token] = mesh;
+			  file >> total_vertices;
 		  }
+		  file >> total_faces;
+		  triangle_mesh = new TriangleMesh();
+		  triangle_meshes.push_back(triangle_mesh);
+		  triangle_mesh->vertices.resize(total_vertices);
+		  for (int i = 0; i < total_vertices; i++)
+			  file >> triangle_mesh->vertices[i];
 
 		  for (int i = 0; i < total_faces; i++) {
 			  file >> P0 >> P1 >> P2;
@@ -584,32 +800,57 @@ bool Scene::load_p3f(const char *name)
 				  P1 += total_vertices;
 				  P2 += total_vertices;
 			  }
-			  triangle = new Triangle(verticesArray[P0], verticesArray[P1], verticesArray[P2]); //vertex index start at 1
-			  if (material) triangle->SetMaterial(material);
-			  this->addObject((Object*)triangle);
+			  MeshTriangle triangle(triangle_mesh, P0, P1, P2); //vertex index start at 1
+			  if (material) triangle.SetMaterial(material);
+			  PrimId id = primitives.Add(triangle);
+			  if (mesh) {
+				  mesh->triangles.push_back(id);
+				  mesh->bbox.extend(triangle.GetBoundingBox());
+			  }
+			  else
+				  this->addObject(id);
 		  }
 	  }
 
+	  else if (cmd == "instance")   //instance name translation rotation(degrees around x, y, z) scale
+	  {
+		  Vector translation, rotation;
+		  float scale;
+
+		  file >> token >> translation >> rotation >> scale;
+		  auto found = meshes.find(token);
+		  if (found == meshes.end() || found->second->triangles.empty()) {
+			  cerr << "unknown or empty mesh '" << token << "'.\n";
+			  break;
+		  }
+		  Mesh* mesh = found->second;
+		  if (mesh->bvh == NULL) {
+			  mesh->bvh = new BVH();
+			  mesh->bvh->setPrimitives(&primitives);
+		  }
+		  Instance instance(mesh, translation, rotation, scale);
+		  if (material) instance.SetMaterial(material);
+		  this->addObject(primitives.Add(instance));
+	  }
+
       else if (cmd == "npl")  //Plane in Hessian form
 	  {
           Vector N;
           float D;
-          Plane* plane;
 
           file >> N >> D;
-          plane = new Plane(N, D);
-	      if (material) plane->SetMaterial(material);
-          this->addObject( (Object*) plane);
+          Plane plane(N, D);
+	      if (material) plane.SetMaterial(material);
+          this->addObject(primitives.Add(plane));
 	  }
 	  else if (cmd == "pl")  // General Plane
 	  {
           Vector P0, P1, P2;
-		  Plane* plane;
 
           file >> P0 >> P1 >> P2;
-          plane = new Plane(P0, P1, P2);
-	      if (material) plane->SetMaterial(material);
-          this->addObject( (Object*) plane);
+          Plane plane(P0, P1, P2);
+	      if (material) plane.SetMaterial(material);
+          this->addObject(primitives.Add(plane));
 	  }
 
       else if (cmd == "light")  // Need to check light color since by default is white
@@ -733,13 +974,21 @@ bool Scene::load_p3f(const char *name)
   }
 
   file.close();
+
+  //the meshes' BVHs are built once all the triangles are stored, so their addresses are final, and with the
+  //builder of the whole file, wherever its accel and bvhnodes lines are
+  for (auto& mesh : meshes)
+	  if (mesh.second->bvh) {
+		  mesh.second->bvh->setBuilder(this->GetBVHBuilder());
+		  mesh.second->bvh->setQuantized(this->GetBVHQuantized());
+		  mesh.second->bvh->Build(mesh.second->triangles);
+	  }
   return true;
 };
 
 void Scene::create_random_scene() {
 	Camera* camera;
 	Material* material;
-	Sphere* sphere;
 
 	set_rand_seed(time(NULL)* time(NULL)* time(NULL));
 	material = NULL;
@@ -759,9 +1008,9 @@ void Scene::create_random_scene() {
 	material = new Material(Color(0.5, 0.5, 0.5), 1.0, Color(0.0, 0.0, 0.0), 0.0, 10, 0, 1);
 
 
-	sphere = new Sphere(Vector(0.0, -1000, 0.0), 1000.0);
-	if (material) sphere->SetMaterial(material);
-	this->addObject((Object*)sphere);
+	Sphere sphere(Vector(0.0, -1000, 0.0), 1000.0);
+	if (material) sphere.SetMaterial(material);
+	this->addObject(primitives.Add(sphere));
 
 	for(int a = -5; a < 5; a++)
 		for (int b = -5; b < 5; b++) {
@@ -773,22 +1022,22 @@ void Scene::create_random_scene() {
 			if ((center - Vector(4.0, 0.2, 0.0)).length() > 0.9) {
 				if (choose_mat < 0.4) {  //diffuse
 					material = new Material(Color(rand_double(), rand_double(), rand_double()), 1.0, Color(0.0, 0.0, 0.0), 0.0, 10, 0, 1);
-					sphere = new Sphere(center, 0.2);
-					if (material) sphere->SetMaterial(material);
-					this->addObject((Object*)sphere);
+					sphere = Sphere(center, 0.2);
+					if (material) sphere.SetMaterial(material);
+					this->addObject(primitives.Add(sphere));
 				}
 				else if (choose_mat < 0.7) {   //metal
 					material = new Material(Color(0.0, 0.0, 0.0), 0.0, Color(rand_double(0.5, 1), rand_double(0.5, 1), rand_double(0.5, 1)), 1.0, 220, 0, 1);
-					sphere = new Sphere(center, 0.2);
-					if (material) sphere->SetMaterial(material);
-					this->addObject((Object*)sphere);
+					sphere = Sphere(center, 0.2);
+					if (material) sphere.SetMaterial(material);
+					this->addObject(primitives.Add(sphere));
 				}
 				else {   //glass
 					//material = new Material(Color(0.8, 0.3, 0.3), 0.0, Color(1.0, 1.0, 1.0), 0.7, 20, 1, 1.5);
 					material = new Material(Color(rand_double(0.6, 1), rand_double(0.6, 1), rand_double(0.6, 1)), 0.0, Color(1.0, 1.0, 1.0), 0.7, 20, 1, 1.5);
-					sphere = new Sphere(center, 0.2);
-					if (material) sphere->SetMaterial(material);
-					this->addObject((Object*)sphere);
+					sphere = Sphere(center, 0.2);
+					if (material) sphere.SetMaterial(material);
+					this->addObject(primitives.Add(sphere));
 				}
 
 			}
@@ -796,17 +1045,17 @@ void Scene::create_random_scene() {
 		}
 
 	material = new Material(Color(1.0, 1.0, 1.0), 0.0, Color(1.0, 1.0, 1.0), 0.7, 20, 1, 1.5);
-	sphere = new Sphere(Vector(0.0, 1.0, 0.0), 1.0);
-	if (material) sphere->SetMaterial(material);
-	this->addObject((Object*)sphere);
+	sphere = Sphere(Vector(0.0, 1.0, 0.0), 1.0);
+	if (material) sphere.SetMaterial(material);
+	this->addObject(primitives.Add(sphere));
 
 	material = new Material(Color(0.4, 0.2, 0.1), 0.9, Color(1.0, 1.0, 1.0), 0.0, 10, 0, 1.0);
-	sphere = new Sphere(Vector(-4.0, 1.0, 0.0), 1.0);
-	if (material) sphere->SetMaterial(material);
-	this->addObject((Object*)sphere);
+	sphere = Sphere(Vector(-4.0, 1.0, 0.0), 1.0);
+	if (material) sphere.SetMaterial(material);
+	this->addObject(primitives.Add(sphere));
 
 	material = new Material(Color(0.4, 0.2, 0.1), 0.0, Color(0.7, 0.6, 0.5), 1.0, 220, 0, 1.0);
-	sphere = new Sphere(Vector(4.0, 1.0, 0.0), 1.0);
-	if (material) sphere->SetMaterial(material);
-	this->addObject((Object*)sphere);
+	sphere = Sphere(Vector(4.0, 1.0, 0.0), 1.0);
+	if (material) sphere.SetMaterial(material);
+	this->addObject(primitives.Add(sphere));
 }
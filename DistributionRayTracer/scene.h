@@ -2,6 +2,8 @@
 #define SCENE_H
 
 #include <vector>
+#include <map>
+#include <string>
 #include <cmath>
 #include <IL/il.h>
 using namespace std;
@@ -12,6 +14,9 @@ using namespace std;
 #include "ray.h"
 #include "boundingBox.h"
 
+class BVH;
+class Object;
+
 //Light types
 typedef enum {PUNCTUAL, QUAD} lightType;
 
@@ -21,6 +26,17 @@ typedef enum { RIGHT, LEFT, TOP, BOTTOM, FRONT, BACK } CubeMap;
 //Type of acceleration structure
 typedef enum { NONE, GRID_ACC, BVH_ACC }  accelerator;
 
+//Construction algorithm of the BVH: binned SAH (slower, better tree), LBVH (Morton codes, fast)
+//or SBVH (binned SAH that may also split objects across planes, for large overlapping primitives)
+typedef enum { SAH_BUILD, LBVH_BUILD, SBVH_BUILD } bvhBuilder;
+
+//Every object of a scene is stored in the array of its type in the scene's Primitives. The scene and the
+//accelerators refer to an object by a 32-bit id: its type in the top bits, its index in that array in the rest
+typedef unsigned int PrimId;
+typedef enum { TRIANGLE_PRIM, MESH_TRIANGLE_PRIM, SPHERE_PRIM, BOX_PRIM, PLANE_PRIM, INSTANCE_PRIM } primType;
+
+//Object::hit only fills isHit, t and what computeSurface needs (bary, primitive); the normal is left to
+//computeSurface, which is called once, for the closest hit
 struct HitRecord
 {
 	bool isHit = false;
@@ -28,6 +44,7 @@ struct HitRecord
 	float t = FLT_MAX;            // ray parameter
 	Vector bary;  //barycentric coordinates for interpolation in a triangle
 	Vector texUV;  //interpolated texCoord in the hit point
+	const Object* primitive = NULL;  //triangle hit inside an instance's mesh
 };
 
 
@@ -112,16 +129,25 @@ public:
 
 	Material* GetMaterial() const { return m_Material; }
 	void SetMaterial( Material *a_Mat ) { m_Material = a_Mat; }
-	virtual HitRecord hit( Ray& r) const = 0;
+	virtual HitRecord hit( Ray& r) const = 0;   //closest hit with r.tmin <= t <= r.tmax
+	virtual void computeSurface(const Ray&, HitRecord&) const {}   //normal of a hit of r: already set by hit() unless overridden
+	virtual bool occludes(Ray& r) const { return hit(r).isHit; }  //shadow rays: any hit within the ray's interval
 	virtual AABB GetBoundingBox() { return AABB(); }
+	//planes have no bounds: the accelerators keep them out of their cells and nodes and test them with every ray
+	virtual bool IsBounded(void) const { return true; }
+	//triangles give their first vertex and edges to the SIMD leaves of the accelerators; other objects return false
+	virtual bool GetTriangle(Vector&, Vector&, Vector&) const { return false; }
+	virtual bool GetSphere(Vector&, float&) const { return false; }   //likewise for spheres
 	Vector getCentroid(void) { return GetBoundingBox().centroid(); }
+	//bounds of the parts of the object inside bbox on each side of the plane, for the SBVH builder
+	virtual void SplitBoundingBox(const AABB& bbox, int axis, float position, AABB& left, AABB& right);
 
 protected:
 	Material* m_Material;
 
 };
 
-class Plane : public Object
+class Plane final : public Object
 {
 protected:
   Vector	 PN;
@@ -131,15 +157,19 @@ public:
 		 Plane		(Vector& PNc, float Dc);
 		 Plane		(Vector& P0, Vector& P1, Vector& P2);
 
+		 bool IsBounded(void) const { return false; }
 		 HitRecord hit(Ray& r) const;
 };
 
-class Triangle : public Object
+class Triangle final : public Object
 {
 public:
 	Triangle	(Vector& P0, Vector& P1, Vector& P2);
 	AABB GetBoundingBox(void);
+	void SplitBoundingBox(const AABB& bbox, int axis, float position, AABB& left, AABB& right);
+	bool GetTriangle(Vector& p0, Vector& edge1, Vector& edge2) const;
 	HitRecord hit(Ray& r) const;
+	void computeSurface(const Ray& r, HitRecord& rec) const;
 
 protected:
 	Vector points[3];
@@ -148,13 +178,42 @@ protected:
 	Vector Min, Max;
 };
 
+class TriangleMesh;
+
+//A face of a TriangleMesh: the indices of its vertices and its two edges from the first one, in 64 bytes
+class MeshTriangle final : public Object
+{
+public:
+	MeshTriangle(const TriangleMesh* a_mesh, unsigned i0, unsigned i1, unsigned i2);
+	AABB GetBoundingBox(void);
+	void SplitBoundingBox(const AABB& bbox, int axis, float position, AABB& left, AABB& right);
+	bool GetTriangle(Vector& p0, Vector& edge1, Vector& edge2) const;
+	HitRecord hit(Ray& r) const;
+	void computeSurface(const Ray& r, HitRecord& rec) const;
+
+private:
+	const TriangleMesh* mesh;
+	unsigned indices[3];
+	Vector edge1, edge2;   //points[1] - points[0] and points[2] - points[0]
+};
+
+//Vertices of a mesh command, stored once for all its faces
+class TriangleMesh
+{
+public:
+	vector<Vector> vertices;
+};
+
 
 
-class Sphere : public Object
+class Sphere final : public Object
 {
 public:
 	Sphere( const Vector& a_center, float a_radius ) : center( a_center ), SqRadius( a_radius * a_radius ), radius( a_radius ) {};
+	void SetCenter(const Vector& a_center) { center = a_center; }   //moving objects: refit the accelerator afterwards
+	bool GetSphere(Vector& a_center, float& a_radius) const { a_center = center; a_radius = radius; return true; }
 	HitRecord hit(Ray& r) const;
+	void computeSurface(const Ray& r, HitRecord& rec) const;
 	AABB GetBoundingBox(void);
 
 private:
@@ -162,10 +221,11 @@ private:
 	float radius, SqRadius;
 };
 
-class aaBox : public Object   //Axis aligned box: another geometric object
+class aaBox final : public Object   //Axis aligned box: another geometric object
 {
 public:
 	aaBox(Vector& minPoint, Vector& maxPoint);
+	void SetCorners(const Vector& minPoint, const Vector& maxPoint) { min = minPoint; max = maxPoint; }
 	AABB GetBoundingBox(void);
 	HitRecord hit(Ray& r) const;
 
@@ -177,6 +237,96 @@ private:
 };
 
 
+//Named triangle mesh, drawn only through its instances. The triangles are stored once, in the mesh's own
+//BVH (the bottom level); the instances are objects of the scene's accelerator (the top level)
+struct Mesh
+{
+	vector<PrimId> triangles;
+	AABB bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+	BVH* bvh = NULL;   //created by the first instance, built once the scene is loaded
+};
+
+class Instance final : public Object   //a mesh placed in the scene: scaled, rotated and then translated
+{
+public:
+	Instance(Mesh* a_mesh, const Vector& a_translation, const Vector& a_rotation, float a_scale);
+	HitRecord hit(Ray& r) const;
+	void computeSurface(const Ray& r, HitRecord& rec) const;
+	bool occludes(Ray& r) const;
+	AABB GetBoundingBox(void) { return bbox; }
+
+private:
+	Vector to_world(const Vector& v) const;   //rotation and scale only
+	Vector to_local(const Vector& v) const;
+
+	Mesh* mesh;
+	Vector rows[3];   //rotation matrix
+	Vector translation;
+	float scale;
+	AABB bbox;
+};
+
+//The objects of a scene, each type in its own contiguous array. Hit and Occludes dispatch on the type of
+//the id, and the classes are final, so the accelerators intersect objects without virtual calls
+class Primitives
+{
+public:
+	static const int IndexBits = 28;
+
+	PrimId Add(const Triangle& o) { return add(triangles, o, TRIANGLE_PRIM); }
+	PrimId Add(const MeshTriangle& o) { return add(mesh_triangles, o, MESH_TRIANGLE_PRIM); }
+	PrimId Add(const Sphere& o) { return add(spheres, o, SPHERE_PRIM); }
+	PrimId Add(const aaBox& o) { return add(boxes, o, BOX_PRIM); }
+	PrimId Add(const Plane& o) { return add(planes, o, PLANE_PRIM); }
+	PrimId Add(const Instance& o) { return add(instances, o, INSTANCE_PRIM); }
+
+	//the addresses stay valid until the next Add
+	Object* Get(PrimId id) {
+		unsigned int index = id & ((1u << IndexBits) - 1);
+		switch (id >> IndexBits) {
+		case TRIANGLE_PRIM: return &triangles[index];
+		case MESH_TRIANGLE_PRIM: return &mesh_triangles[index];
+		case SPHERE_PRIM: return &spheres[index];
+		case BOX_PRIM: return &boxes[index];
+		case PLANE_PRIM: return &planes[index];
+		default: return &instances[index];
+		}
+	}
+	const Object* Get(PrimId id) const { return const_cast<Primitives*>(this)->Get(id); }
+
+	HitRecord Hit(PrimId id, Ray& r) const {
+		unsigned int index = id & ((1u << IndexBits) - 1);
+		switch (id >> IndexBits) {
+		case TRIANGLE_PRIM: return triangles[index].hit(r);
+		case MESH_TRIANGLE_PRIM: return mesh_triangles[index].hit(r);
+		case SPHERE_PRIM: return spheres[index].hit(r);
+		case BOX_PRIM: return boxes[index].hit(r);
+		case PLANE_PRIM: return planes[index].hit(r);
+		default: return instances[index].hit(r);
+		}
+	}
+
+	bool Occludes(PrimId id, Ray& r) const {
+		if ((id >> IndexBits) == INSTANCE_PRIM)
+			return instances[id & ((1u << IndexBits) - 1)].occludes(r);
+		return Hit(id, r).isHit;
+	}
+
+private:
+	template <class T> static PrimId add(vector<T>& array, const T& o, primType type) {
+		array.push_back(o);
+		return ((PrimId)type << IndexBits) | (PrimId)(array.size() - 1);
+	}
+
+	vector<Triangle> triangles;
+	vector<MeshTriangle> mesh_triangles;
+	vector<Sphere> spheres;
+	vector<aaBox> boxes;
+	vector<Plane> planes;
+	vector<Instance> instances;
+};
+
+
 class Scene
 {
 public:
@@ -189,17 +339,25 @@ public:
 	Color GetSkyboxColor(Ray& r);
 	unsigned int GetSamplesPerPixel() { return samples_per_pixel; }
 	accelerator GetAccelStruct() { return accel_struc_type; }
+	bvhBuilder GetBVHBuilder() { return bvh_builder; }
+	bool GetBVHQuantized() { return bvh_quantized; }
+	bool GetGridTwoLevel() { return grid_two_level; }
 
 	void SetBackgroundColor(Color a_bgColor) { bgColor = a_bgColor; }
 	void SetSkyBoxFlg(bool a_skybox_flg) {SkyBoxFlg = a_skybox_flg;}
 	void LoadSkybox(const char*);
 	void SetCamera(Camera *a_camera) {camera = a_camera; }
 	void SetAccelStruct(accelerator accel_t) { accel_struc_type = accel_t; }
+	void SetBVHBuilder(bvhBuilder builder) { bvh_builder = builder; }
+	void SetBVHQuantized(bool quantized) { bvh_quantized = quantized; }
+	void SetGridTwoLevel(bool two_level) { grid_two_level = two_level; }
 	void SetSamplesPerPixel(unsigned int spp) { samples_per_pixel = spp; }
 
 	int getNumObjects( );
-	void addObject( Object* o );
+	void addObject( PrimId id );
 	Object* getObject( unsigned int index );
+	PrimId getObjectId( unsigned int index ) { return objects[index]; }
+	Primitives* GetPrimitives() { return &primitives; }
 
 	int getNumLights( );
 	void addLight( Light* l );
@@ -209,13 +367,19 @@ public:
 	void create_random_scene();
 
 private:
-	vector<Object *> objects;
+	Primitives primitives;
+	vector<PrimId> objects;
 	vector<Light *> lights;
+	map<string, Mesh *> meshes;   //named meshes, see the instance command
+	vector<TriangleMesh *> triangle_meshes;   //storage of the triangles of all the mesh commands
 
 	Camera* camera;
 	Color bgColor;  //Background color
 	unsigned int samples_per_pixel;  // samples per pixel
 	accelerator accel_struc_type;
+	bvhBuilder bvh_builder = SAH_BUILD;
+	bool bvh_quantized = false;   //8-bit child boxes in the BVH nodes
+	bool grid_two_level = false;   //sub-grids in the overfull cells of the grid
 
 	bool SkyBoxFlg;
 	struct {
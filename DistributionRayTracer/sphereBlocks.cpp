@@ -0,0 +1,178 @@
+#include <immintrin.h>
+#include <cmath>
+#include "rayAccelerator.h"
+#include "macros.h"
+
+using namespace std;
+
+/****************************************************************************************************
+SIMD spheres: like the triangles in triangleBlocks.cpp, the spheres of a leaf (or all the spheres of a
+scene traced without an accelerator) are stored in blocks of 4 (SSE) or 8 (AVX2) lanes, the x, y and z
+of the centers, the radii and the squared radii each in its own array. The kernel repeats Sphere::hit
+operation by operation, so a lane hits exactly when the scalar test does, at the same t.
+Unused lanes have a NaN center: every comparison on them is false, so they never pass the final test.
+*****************************************************************************************************/
+
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+static const bool UseAVX2 = HasAVX2();
+
+// Nearest hit of the ray among n_blocks blocks of 4 spheres, or any hit if any_hit is set. Returns the
+// index of the sphere (block * 4 + lane), or -1, and its t. If lanes isn't NULL, only the lanes set in
+// lanes[block] are hit
+static int hit_blocks_sse(const float* data, int n_blocks, const unsigned char* lanes, const Ray& ray, bool any_hit, float& hit_t) {
+	const __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+	const __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+	const __m128 zero = _mm_setzero_ps(), sign = _mm_set1_ps(-0.0f);
+	const __m128 t_min = _mm_set1_ps(ray.tmin);
+	float t_max = ray.tmax;
+	int nearest = -1;
+
+	for (int b = 0; b < n_blocks; b++) {
+		int enabled = lanes ? lanes[b] : 0xFF;
+		if (enabled == 0) continue;
+		const float* block = data + b * 20;
+		__m128 cx = _mm_loadu_ps(block), cy = _mm_loadu_ps(block + 4), cz = _mm_loadu_ps(block + 8);
+		__m128 radius = _mm_loadu_ps(block + 12), sq_radius = _mm_loadu_ps(block + 16);
+		__m128 tmax = _mm_set1_ps(t_max);
+
+		// offset = origin - center, b = offset * direction, dist = offset * offset - radius^2
+		__m128 sx = _mm_sub_ps(ox, cx), sy = _mm_sub_ps(oy, cy), sz = _mm_sub_ps(oz, cz);
+		__m128 bb = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, dx), _mm_mul_ps(sy, dy)), _mm_mul_ps(sz, dz));
+		__m128 dist = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, sx), _mm_mul_ps(sy, sy)), _mm_mul_ps(sz, sz)), sq_radius);
+		__m128 reject = _mm_and_ps(_mm_cmpgt_ps(dist, zero), _mm_cmpgt_ps(bb, zero));   //outside and moving away
+
+		__m128 neg_b = _mm_xor_ps(bb, sign);
+		reject = _mm_or_ps(reject, _mm_cmpgt_ps(_mm_sub_ps(neg_b, radius), tmax));
+		reject = _mm_or_ps(reject, _mm_cmplt_ps(_mm_add_ps(neg_b, radius), t_min));
+
+		__m128 disc = _mm_sub_ps(_mm_mul_ps(bb, bb), dist);
+		reject = _mm_or_ps(reject, _mm_cmplt_ps(disc, zero));
+
+		// the near hit, or the far one if the near one is before tmin
+		__m128 root = _mm_sqrt_ps(disc);
+		__m128 t = _mm_xor_ps(_mm_add_ps(bb, root), sign);
+		__m128 before = _mm_cmplt_ps(t, t_min);
+		t = _mm_or_ps(_mm_andnot_ps(before, t), _mm_and_ps(before, _mm_sub_ps(root, bb)));
+		__m128 valid = _mm_andnot_ps(reject, _mm_and_ps(_mm_cmpge_ps(t, t_min), _mm_cmple_ps(t, tmax)));
+
+		int mask = _mm_movemask_ps(valid) & enabled;
+		if (mask == 0) continue;
+
+		float ts[4];
+		_mm_storeu_ps(ts, t);
+		for (int lane = 0; lane < 4; lane++) {   //in order, as in TriangleBlocks
+			if (!(mask & (1 << lane)) || ts[lane] > t_max) continue;
+			t_max = ts[lane];
+			nearest = b * 4 + lane;
+			hit_t = ts[lane];
+			if (any_hit) return nearest;
+		}
+	}
+	return nearest;
+}
+
+// Same as hit_blocks_sse, with blocks of 8 spheres
+TARGET_AVX2 static int hit_blocks_avx2(const float* data, int n_blocks, const unsigned char* lanes, const Ray& ray, bool any_hit, float& hit_t) {
+	const __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+	const __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+	const __m256 zero = _mm256_setzero_ps(), sign = _mm256_set1_ps(-0.0f);
+	const __m256 t_min = _mm256_set1_ps(ray.tmin);
+	float t_max = ray.tmax;
+	int nearest = -1;
+
+	for (int b = 0; b < n_blocks; b++) {
+		int enabled = lanes ? lanes[b] : 0xFF;
+		if (enabled == 0) continue;
+		const float* block = data + b * 40;
+		__m256 cx = _mm256_loadu_ps(block), cy = _mm256_loadu_ps(block + 8), cz = _mm256_loadu_ps(block + 16);
+		__m256 radius = _mm256_loadu_ps(block + 24), sq_radius = _mm256_loadu_ps(block + 32);
+		__m256 tmax = _mm256_set1_ps(t_max);
+
+		__m256 sx = _mm256_sub_ps(ox, cx), sy = _mm256_sub_ps(oy, cy), sz = _mm256_sub_ps(oz, cz);
+		__m256 bb = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, dx), _mm256_mul_ps(sy, dy)), _mm256_mul_ps(sz, dz));
+		__m256 dist = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, sx), _mm256_mul_ps(sy, sy)), _mm256_mul_ps(sz, sz)), sq_radius);
+		__m256 reject = _mm256_and_ps(_mm256_cmp_ps(dist, zero, _CMP_GT_OQ), _mm256_cmp_ps(bb, zero, _CMP_GT_OQ));
+
+		__m256 neg_b = _mm256_xor_ps(bb, sign);
+		reject = _mm256_or_ps(reject, _mm256_cmp_ps(_mm256_sub_ps(neg_b, radius), tmax, _CMP_GT_OQ));
+		reject = _mm256_or_ps(reject, _mm256_cmp_ps(_mm256_add_ps(neg_b, radius), t_min, _CMP_LT_OQ));
+
+		__m256 disc = _mm256_sub_ps(_mm256_mul_ps(bb, bb), dist);
+		reject = _mm256_or_ps(reject, _mm256_cmp_ps(disc, zero, _CMP_LT_OQ));
+
+		__m256 root = _mm256_sqrt_ps(disc);
+		__m256 t = _mm256_xor_ps(_mm256_add_ps(bb, root), sign);
+		t = _mm256_blendv_ps(t, _mm256_sub_ps(root, bb), _mm256_cmp_ps(t, t_min, _CMP_LT_OQ));
+		__m256 valid = _mm256_andnot_ps(reject, _mm256_and_ps(_mm256_cmp_ps(t, t_min, _CMP_GE_OQ), _mm256_cmp_ps(t, tmax, _CMP_LE_OQ)));
+
+		int mask = _mm256_movemask_ps(valid) & enabled;
+		if (mask == 0) continue;
+
+		float ts[8];
+		_mm256_storeu_ps(ts, t);
+		for (int lane = 0; lane < 8; lane++) {
+			if (!(mask & (1 << lane)) || ts[lane] > t_max) continue;
+			t_max = ts[lane];
+			nearest = b * 8 + lane;
+			hit_t = ts[lane];
+			if (any_hit) return nearest;
+		}
+	}
+	return nearest;
+}
+
+int SphereBlocks::Width(void) { return UseAVX2 ? 8 : 4; }
+
+void SphereBlocks::Clear(void) {
+	data.clear();
+}
+
+int SphereBlocks::Add(const Primitives& primitives, const PrimId* objs, int n_objs) {
+	int width = Width(), block_size = 5 * width;
+	if (n_objs == 0) return -1;
+
+	size_t start = data.size();
+	int first = start / block_size;
+	data.resize(start + (size_t)((n_objs + width - 1) / width) * block_size, NAN);   //NaN centers: unused lanes never hit
+
+	for (int i = 0; i < n_objs; i++) {
+		Vector center;
+		float radius;
+		if (!primitives.Get(objs[i])->GetSphere(center, radius)) {
+			data.resize(start);
+			return -1;
+		}
+		float* block = &data[start + (size_t)(i / width) * block_size];
+		block[0 * width + i % width] = center.x;
+		block[1 * width + i % width] = center.y;
+		block[2 * width + i % width] = center.z;
+		block[3 * width + i % width] = radius;
+		block[4 * width + i % width] = radius * radius;
+	}
+	return first;
+}
+
+int SphereBlocks::Hit(int block, int n_objs, const Ray& ray, HitRecord& rec, const unsigned char* lanes) const {
+	int width = Width(), n_blocks = (n_objs + width - 1) / width;
+	const float* blocks = &data[(size_t)block * 5 * width];
+	float t;
+	int nearest = UseAVX2 ? hit_blocks_avx2(blocks, n_blocks, lanes, ray, false, t) : hit_blocks_sse(blocks, n_blocks, lanes, ray, false, t);
+	if (nearest < 0) return -1;
+
+	rec = HitRecord();
+	rec.isHit = true;
+	rec.t = t;
+	return nearest;
+}
+
+bool SphereBlocks::Occludes(int block, int n_objs, const Ray& ray, const unsigned char* lanes) const {
+	int width = Width(), n_blocks = (n_objs + width - 1) / width;
+	const float* blocks = &data[(size_t)block * 5 * width];
+	float t;
+	return (UseAVX2 ? hit_blocks_avx2(blocks, n_blocks, lanes, ray, true, t) : hit_blocks_sse(blocks, n_blocks, lanes, ray, true, t)) >= 0;
+}
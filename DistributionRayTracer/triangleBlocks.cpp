@@ -0,0 +1,227 @@
+#include <immintrin.h>
+#include "rayAccelerator.h"
+#include "macros.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+/****************************************************************************************************
+SIMD leaves: the triangles of a leaf are stored in blocks of 4 (SSE) or 8 (AVX2) lanes, each coordinate
+of the first vertex and of the two edges in its own array, and one ray is tested against a whole block
+with the Moller-Trumbore algorithm. The kernel repeats Triangle::hit operation by operation, so a lane
+hits exactly when the scalar test does, with the same t and barycentrics.
+The AVX2 kernel is compiled for AVX2 only (GCC needs the target attribute, MSVC accepts the intrinsics
+anywhere) and is only called when the CPU supports it, so the same binary runs everywhere.
+*****************************************************************************************************/
+
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+// AVX2 support of the CPU and of the OS (the upper halves of the YMM registers must be saved)
+bool HasAVX2(void) {
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) return false;
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0, avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static const bool UseAVX2 = HasAVX2();
+
+// EPSILON is a double: the scalar test compares floats against it, which for floats is the same as
+// "t <= EPSILON" <=> "t < Epsilon" and "|u| > EPSILON" <=> "|u| >= Epsilon", with Epsilon rounded up to a float
+static const float Epsilon = (float)EPSILON;
+
+// Nearest hit of the ray among n_blocks blocks of 4 triangles, or any hit if any_hit is set. Returns the
+// index of the triangle (block * 4 + lane), or -1, and its t and barycentrics u, v in hit. If lanes isn't
+// NULL, only the lanes set in lanes[block] are hit
+static int hit_blocks_sse(const float* data, int n_blocks, const unsigned char* lanes, const Ray& ray, bool any_hit, float hit[3]) {
+	const __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+	const __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+	const __m128 eps = _mm_set1_ps(Epsilon), neg_eps = _mm_set1_ps(-Epsilon), one = _mm_set1_ps(1.0f);
+	const __m128 t_min = _mm_set1_ps(ray.tmin);
+	float t_max = ray.tmax;
+	int nearest = -1;
+
+	for (int b = 0; b < n_blocks; b++) {
+		int enabled = lanes ? lanes[b] : 0xFF;
+		if (enabled == 0) continue;
+		const float* block = data + b * 36;
+		__m128 p0x = _mm_loadu_ps(block), p0y = _mm_loadu_ps(block + 4), p0z = _mm_loadu_ps(block + 8);
+		__m128 e1x = _mm_loadu_ps(block + 12), e1y = _mm_loadu_ps(block + 16), e1z = _mm_loadu_ps(block + 20);
+		__m128 e2x = _mm_loadu_ps(block + 24), e2y = _mm_loadu_ps(block + 28), e2z = _mm_loadu_ps(block + 32);
+
+		// ray_cross_e2 = direction % edge2, det = edge1 * ray_cross_e2
+		__m128 cx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+		__m128 cy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+		__m128 cz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+		__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, cx), _mm_mul_ps(e1y, cy)), _mm_mul_ps(e1z, cz));
+		__m128 valid = _mm_or_ps(_mm_cmple_ps(det, neg_eps), _mm_cmpge_ps(det, eps));
+		__m128 inv_det = _mm_div_ps(one, det);
+
+		// s = origin - p0, u = inv_det * (s * ray_cross_e2)
+		__m128 sx = _mm_sub_ps(ox, p0x), sy = _mm_sub_ps(oy, p0y), sz = _mm_sub_ps(oz, p0z);
+		__m128 u = _mm_mul_ps(inv_det, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, cx), _mm_mul_ps(sy, cy)), _mm_mul_ps(sz, cz)));
+		valid = _mm_andnot_ps(_mm_cmple_ps(u, neg_eps), valid);
+		valid = _mm_andnot_ps(_mm_and_ps(_mm_cmpgt_ps(u, one), _mm_cmpge_ps(_mm_sub_ps(u, one), eps)), valid);
+
+		// s_cross_e1 = s % edge1, t = inv_det * (edge2 * s_cross_e1)
+		__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+		__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+		__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+		__m128 t = _mm_mul_ps(inv_det, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)));
+		valid = _mm_and_ps(valid, _mm_cmpge_ps(t, eps));
+		valid = _mm_and_ps(valid, _mm_cmpge_ps(t, t_min));
+		valid = _mm_and_ps(valid, _mm_cmple_ps(t, _mm_set1_ps(t_max)));
+
+		// v = (inv_det * direction) * s_cross_e1
+		__m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(dx, inv_det), qx), _mm_mul_ps(_mm_mul_ps(dy, inv_det), qy)),
+			_mm_mul_ps(_mm_mul_ps(dz, inv_det), qz));
+		__m128 uv = _mm_add_ps(u, v);
+		valid = _mm_andnot_ps(_mm_cmple_ps(v, neg_eps), valid);
+		valid = _mm_andnot_ps(_mm_and_ps(_mm_cmpgt_ps(uv, one), _mm_cmpge_ps(_mm_sub_ps(uv, one), eps)), valid);
+
+		int mask = _mm_movemask_ps(valid) & enabled;
+		if (mask == 0) continue;
+
+		float ts[4], us[4], vs[4];
+		_mm_storeu_ps(ts, t);
+		_mm_storeu_ps(us, u);
+		_mm_storeu_ps(vs, v);
+		//lanes in order, like the objects of a leaf in the scalar loop: a later hit at the same t wins
+		for (int lane = 0; lane < 4; lane++) {
+			if (!(mask & (1 << lane)) || ts[lane] > t_max) continue;
+			t_max = ts[lane];
+			nearest = b * 4 + lane;
+			hit[0] = ts[lane]; hit[1] = us[lane]; hit[2] = vs[lane];
+			if (any_hit) return nearest;
+		}
+	}
+	return nearest;
+}
+
+// Same as hit_blocks_sse, with blocks of 8 triangles
+TARGET_AVX2 static int hit_blocks_avx2(const float* data, int n_blocks, const unsigned char* lanes, const Ray& ray, bool any_hit, float hit[3]) {
+	const __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+	const __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+	const __m256 eps = _mm256_set1_ps(Epsilon), neg_eps = _mm256_set1_ps(-Epsilon), one = _mm256_set1_ps(1.0f);
+	const __m256 t_min = _mm256_set1_ps(ray.tmin);
+	float t_max = ray.tmax;
+	int nearest = -1;
+
+	for (int b = 0; b < n_blocks; b++) {
+		int enabled = lanes ? lanes[b] : 0xFF;
+		if (enabled == 0) continue;
+		const float* block = data + b * 72;
+		__m256 p0x = _mm256_loadu_ps(block), p0y = _mm256_loadu_ps(block + 8), p0z = _mm256_loadu_ps(block + 16);
+		__m256 e1x = _mm256_loadu_ps(block + 24), e1y = _mm256_loadu_ps(block + 32), e1z = _mm256_loadu_ps(block + 40);
+		__m256 e2x = _mm256_loadu_ps(block + 48), e2y = _mm256_loadu_ps(block + 56), e2z = _mm256_loadu_ps(block + 64);
+
+		__m256 cx = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+		__m256 cy = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+		__m256 cz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+		__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, cx), _mm256_mul_ps(e1y, cy)), _mm256_mul_ps(e1z, cz));
+		__m256 valid = _mm256_or_ps(_mm256_cmp_ps(det, neg_eps, _CMP_LE_OQ), _mm256_cmp_ps(det, eps, _CMP_GE_OQ));
+		__m256 inv_det = _mm256_div_ps(one, det);
+
+		__m256 sx = _mm256_sub_ps(ox, p0x), sy = _mm256_sub_ps(oy, p0y), sz = _mm256_sub_ps(oz, p0z);
+		__m256 u = _mm256_mul_ps(inv_det, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, cx), _mm256_mul_ps(sy, cy)), _mm256_mul_ps(sz, cz)));
+		valid = _mm256_andnot_ps(_mm256_cmp_ps(u, neg_eps, _CMP_LE_OQ), valid);
+		valid = _mm256_andnot_ps(_mm256_and_ps(_mm256_cmp_ps(u, one, _CMP_GT_OQ), _mm256_cmp_ps(_mm256_sub_ps(u, one), eps, _CMP_GE_OQ)), valid);
+
+		__m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+		__m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+		__m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+		__m256 t = _mm256_mul_ps(inv_det, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)));
+		valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, eps, _CMP_GE_OQ));
+		valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, t_min, _CMP_GE_OQ));
+		valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(t_max), _CMP_LE_OQ));
+
+		__m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(dx, inv_det), qx), _mm256_mul_ps(_mm256_mul_ps(dy, inv_det), qy)),
+			_mm256_mul_ps(_mm256_mul_ps(dz, inv_det), qz));
+		__m256 uv = _mm256_add_ps(u, v);
+		valid = _mm256_andnot_ps(_mm256_cmp_ps(v, neg_eps, _CMP_LE_OQ), valid);
+		valid = _mm256_andnot_ps(_mm256_and_ps(_mm256_cmp_ps(uv, one, _CMP_GT_OQ), _mm256_cmp_ps(_mm256_sub_ps(uv, one), eps, _CMP_GE_OQ)), valid);
+
+		int mask = _mm256_movemask_ps(valid) & enabled;
+		if (mask == 0) continue;
+
+		float ts[8], us[8], vs[8];
+		_mm256_storeu_ps(ts, t);
+		_mm256_storeu_ps(us, u);
+		_mm256_storeu_ps(vs, v);
+		for (int lane = 0; lane < 8; lane++) {
+			if (!(mask & (1 << lane)) || ts[lane] > t_max) continue;
+			t_max = ts[lane];
+			nearest = b * 8 + lane;
+			hit[0] = ts[lane]; hit[1] = us[lane]; hit[2] = vs[lane];
+			if (any_hit) return nearest;
+		}
+	}
+	return nearest;
+}
+
+int TriangleBlocks::Width(void) { return UseAVX2 ? 8 : 4; }
+
+void TriangleBlocks::Clear(void) {
+	data.clear();
+}
+
+int TriangleBlocks::Add(const Primitives& primitives, const PrimId* objs, int n_objs) {
+	int width = Width(), block_size = 9 * width;
+	if (n_objs == 0) return -1;
+
+	size_t start = data.size();
+	int first = start / block_size;
+	data.resize(start + (size_t)((n_objs + width - 1) / width) * block_size, 0.0f);   //zero edges: unused lanes never hit
+
+	for (int i = 0; i < n_objs; i++) {
+		Vector p[3];   //first vertex, edge1, edge2
+		if (!primitives.Get(objs[i])->GetTriangle(p[0], p[1], p[2])) {
+			data.resize(start);
+			return -1;
+		}
+		float* block = &data[start + (size_t)(i / width) * block_size];
+		for (int k = 0; k < 3; k++) {
+			block[(3 * k + 0) * width + i % width] = p[k].x;
+			block[(3 * k + 1) * width + i % width] = p[k].y;
+			block[(3 * k + 2) * width + i % width] = p[k].z;
+		}
+	}
+	return first;
+}
+
+int TriangleBlocks::Hit(int block, int n_objs, const Ray& ray, HitRecord& rec, const unsigned char* lanes) const {
+	int width = Width(), n_blocks = (n_objs + width - 1) / width;
+	const float* blocks = &data[(size_t)block * 9 * width];
+	float hit[3];
+	int nearest = UseAVX2 ? hit_blocks_avx2(blocks, n_blocks, lanes, ray, false, hit) : hit_blocks_sse(blocks, n_blocks, lanes, ray, false, hit);
+	if (nearest < 0) return -1;
+
+	rec = HitRecord();
+	rec.isHit = true;
+	rec.t = hit[0];
+	rec.bary = Vector(1.0f - hit[1] - hit[2], hit[1], hit[2]);
+	return nearest;
+}
+
+bool TriangleBlocks::Occludes(int block, int n_objs, const Ray& ray, const unsigned char* lanes) const {
+	int width = Width(), n_blocks = (n_objs + width - 1) / width;
+	const float* blocks = &data[(size_t)block * 9 * width];
+	float hit[3];
+	return (UseAVX2 ? hit_blocks_avx2(blocks, n_blocks, lanes, ray, true, hit) : hit_blocks_sse(blocks, n_blocks, lanes, ray, true, hit)) >= 0;
+}
@@ -6,10 +6,16 @@ float Vector::length()
 	return sqrt( x * x + y * y + z * z );
 }
 
-float Vector::getAxisValue(int axis) {
+float Vector::getAxisValue(int axis) const {
 	return (axis == 0) ? x : (axis == 1) ? y : z;
 }
 
+void Vector::setAxisValue(int axis, float value) {
+	if (axis == 0) x = value;
+	else if (axis == 1) y = value;
+	else z = value;
+}
+
 // --------------------------------------------------------------------- copy constructor
 Vector::Vector(const Vector& v)
 {
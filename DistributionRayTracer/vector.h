@@ -16,7 +16,8 @@ public:
 
 	float length();
 
-	float getAxisValue(int axis);
+	float getAxisValue(int axis) const;
+	void setAxisValue(int axis, float value);
 
 	Vector&	normalize();
 	Vector operator-() const {